@@ -0,0 +1,37 @@
+// synthetic children for the benchmark build; each one writes lines stamped
+// with the time of writing, at the given rate, for BENCH_DURATION seconds;
+// .content is BENCH_CONTENT_ASCII unless set to BENCH_CONTENT_UTF8 or
+// BENCH_CONTENT_CONTROL
+
+// in seconds
+#define BENCH_DURATION 10
+
+#define CHILDREN_COUNT 5
+
+const struct child_configuration child_configuration[CHILDREN_COUNT] = {
+    {
+        .name = "STEADY",
+        .termination_signal = SIGTERM,
+        .benchmark = { .lines_per_second = 100000, .line_length = 100, .burst = 1 }
+    },
+    {
+        .name = "BURSTY",
+        .termination_signal = SIGTERM,
+        .benchmark = { .lines_per_second = 100000, .line_length = 60, .burst = 1000 }
+    },
+    {
+        .name = "LONG",
+        .termination_signal = SIGTERM,
+        .benchmark = { .lines_per_second = 2000, .line_length = 8192, .burst = 10 }
+    },
+    {
+        .name = "UTF8",
+        .termination_signal = SIGTERM,
+        .benchmark = { .lines_per_second = 20000, .line_length = 100, .burst = 10, .content = BENCH_CONTENT_UTF8 }
+    },
+    {
+        .name = "CONTROL",
+        .termination_signal = SIGTERM,
+        .benchmark = { .lines_per_second = 20000, .line_length = 100, .burst = 10, .content = BENCH_CONTENT_CONTROL }
+    }
+};
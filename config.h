@@ -1,10 +1,148 @@
-// this length includes a terminating line feed
+// this length includes a terminating line feed; stream buffers only grow
+// towards it as lines require, so it can be raised well beyond typical lines
 #define MAX_LINE_LENGTH 120
 
-// in seconds
+// what happens to a line longer than MAX_LINE_LENGTH: LONG_LINE_SPLIT writes
+// the rest as further prefixed lines, LONG_LINE_TRUNCATE drops it, and
+// LONG_LINE_PASSTHROUGH keeps it on the same output line; while such a line
+// is being passed through, other children writing to the same destination
+// are held back until it ends
+#define LONG_LINE_POLICY LONG_LINE_SPLIT
+
+// in bytes, per child stream; buffers start at STREAM_BUFFER_MIN_SIZE and
+// grow up to STREAM_BUFFER_SIZE while a child keeps the pipe full, so that a
+// busy pipe is drained in as few reads as possible
+#define STREAM_BUFFER_MIN_SIZE 1024
+#define STREAM_BUFFER_SIZE 65536
+
+// in seconds, that a child may take to exit after being asked to before it
+// is killed, unless it sets its own shutdown_timeout
 #define SHUTDOWN_TIMEOUT 10
 
+// children with a restart policy are started again after a delay that
+// starts at RESTART_BACKOFF_INITIAL and doubles on each quick exit, up to
+// RESTART_BACKOFF_MAX, both in milliseconds; a child restarted more than
+// RESTART_MAX_IN_WINDOW times within RESTART_WINDOW seconds brings the
+// whole tree down instead
+#define RESTART_BACKOFF_INITIAL 100
+#define RESTART_BACKOFF_MAX 30000
+#define RESTART_WINDOW 60
+#define RESTART_MAX_IN_WINDOW 5
+
+// on SIGHUP, running children other than startup checks are restarted
+// RELOAD_BATCH_SIZE at a time, each batch once the one before is running
+// again and has passed its probe, if it has one
+#define RELOAD_BATCH_SIZE 1
+
+// set to 0 to launch children with fork() and execv() instead of
+// posix_spawn(), which avoids copying the supervisor's page tables; OpenBSD
+// always uses fork() so that children can pledge before exec
+#define USE_POSIX_SPAWN 1
+
+// EVENT_BACKEND_DEFAULT picks epoll on Linux, kqueue on the BSDs and poll
+// elsewhere; EVENT_BACKEND_POLL, EVENT_BACKEND_EPOLL or EVENT_BACKEND_KQUEUE
+// force a particular one
+#define EVENT_BACKEND EVENT_BACKEND_DEFAULT
+
+// OUTPUT_FLUSH_PER_ITERATION gathers every line completed during one poll
+// wakeup and writes them with a single writev() per destination, while
+// OUTPUT_FLUSH_PER_LINE writes each line as soon as it is complete
+#define OUTPUT_FLUSH_POLICY OUTPUT_FLUSH_PER_ITERATION
+
+// in bytes, per destination; lines are staged here until they are flushed
+#define OUTPUT_BATCH_SIZE 16384
+
+// in bytes, per destination; output the destination is not ready for waits
+// here, as stdout and stderr are written without blocking
+#define OUTPUT_QUEUE_SIZE (1024 * 1024)
+
+// what happens as the queue fills up: OUTPUT_OVERFLOW_BLOCK stops reading
+// from children writing to that destination until it drains, so that they
+// block on their own pipes; OUTPUT_OVERFLOW_DROP_OLDEST drops the oldest
+// queued lines; OUTPUT_OVERFLOW_DROP_MARKED drops new lines and then writes
+// a line saying how many were lost
+#define OUTPUT_OVERFLOW_POLICY OUTPUT_OVERFLOW_BLOCK
+
+// on STATS_SIGNAL, per-child counters and event loop histograms are written
+// to STATS_FD as [STATS] lines of key=value pairs; STATS_SIGNAL_DEFAULT is
+// SIGINFO where the system has it and SIGPWR otherwise
+#define STATS_SIGNAL STATS_SIGNAL_DEFAULT
+#define STATS_FD STDERR_FILENO
+
+// set to 1 to serve the same counters in the Prometheus text format over
+// HTTP on a UNIX socket at METRICS_SOCKET_PATH, from the event loop; each
+// scrape is served from a cached render, rebuilt once something has changed
+#define METRICS_SOCKET 0
+#define METRICS_SOCKET_PATH "/run/simple-supervisor.sock"
+
+// TIMESTAMP_ISO8601 starts every prefixed line with the time in UTC, as in
+// 2024-01-31T12:00:00.000Z, and TIMESTAMP_EPOCH_MS with milliseconds since
+// the epoch; the clock is read once per event loop wakeup, so lines handled
+// together share a timestamp
+#define TIMESTAMP_FORMAT TIMESTAMP_NONE
+
+// OUTPUT_FORMAT_JSON writes each line as an object such as
+// {"src":"NAME","stream":"out","msg":"..."}, led by "ts" when there is a
+// timestamp, and OUTPUT_FORMAT_LOGFMT as src=NAME stream=out msg="...";
+// quotes and backslashes are escaped as control characters are scrubbed, in
+// the same pass, and other bytes are kept as they are, so JSON stays valid as
+// long as children write UTF-8; passthrough children are never encoded
+#define OUTPUT_FORMAT OUTPUT_FORMAT_PLAIN
+
+// children with a log_file have their lines appended to it through a buffer
+// of LOG_FILE_BUFFER_SIZE bytes, written out when full and at least every
+// LOG_FILE_FLUSH_INTERVAL milliseconds; files that have grown to
+// LOG_FILE_ROTATE_SIZE bytes or been open for LOG_FILE_ROTATE_INTERVAL
+// seconds are renamed to .1, .2 and so on up to .LOG_FILE_ROTATE_KEEP, where
+// 0 turns either check off, and every LOG_FILE_SYNC_INTERVAL milliseconds
+// files written to are passed to fdatasync(), unless that is 0, by a helper
+// process so that the supervisor does not wait on the disk
+#define LOG_FILE_BUFFER_SIZE (256 * 1024)
+#define LOG_FILE_FLUSH_INTERVAL 1000
+#define LOG_FILE_ROTATE_SIZE (64 * 1024 * 1024)
+#define LOG_FILE_ROTATE_INTERVAL 0
+#define LOG_FILE_ROTATE_KEEP 5
+#define LOG_FILE_SYNC_INTERVAL 5000
+
+// with IO_WORKERS above 0, that many threads read the output of children,
+// each taking every IO_WORKERS-th child in its own event loop, and pass whole
+// lines to the main thread through a ring of IO_WORKER_RING_SIZE bytes, a
+// power of two, per destination; the supervisor then has to be built with
+// -pthread, and a partial line from a passthrough child waits for its end,
+// while a message about a child may come shortly before its last lines
+#define IO_WORKERS 0
+#define IO_WORKER_RING_SIZE (1024 * 1024)
+
+// children with log_ring set are given a shared memory ring of
+// LOG_RING_SIZE bytes, a power of two, to write lines to without a system
+// call each time; see README.md for how
+#define LOG_RING_SIZE (1024 * 1024)
+
+// what a probe does unless it says otherwise: milliseconds between attempts
+// and before an attempt is given up, and failures in a row that count
+#define PROBE_INTERVAL 1000
+#define PROBE_TIMEOUT 1000
+#define PROBE_FAILURES 3
+
+// a child with a rate_limit may write RATE_LIMIT_BURST milliseconds' worth
+// of it at once, and lines dropped for being over it are reported every
+// RATE_LIMIT_REPORT_INTERVAL milliseconds
+#define RATE_LIMIT_BURST 1000
+#define RATE_LIMIT_REPORT_INTERVAL 10000
+
+// set to 1 to scrub output one byte at a time instead of with SSE2/NEON or
+// word-at-a-time scanning
+#define SCALAR_LINE_SCANNER 0
+
+#ifdef SUPERVISOR_BENCHMARK
+// the benchmark build supervises the synthetic children described there
+#include "bench.h"
+#else
+
 #define CHILDREN_COUNT 3
+// the instances of every child added up, needed once some child has more
+// than one
+// #define INSTANCES_COUNT 3
 
 const struct child_configuration child_configuration[CHILDREN_COUNT] = {
     {
@@ -13,7 +151,8 @@ const struct child_configuration child_configuration[CHILDREN_COUNT] = {
         .receives_sigusr1 = 0,
         .receives_sigusr2 = 0,
         .termination_signal = SIGTERM,
-        .is_startup_check = 0
+        .is_startup_check = 0,
+        .depends_on = { "CHECK", NULL }
     },
     {
         .command = { "/usr/bin/echo", "check done!", NULL },
@@ -33,5 +172,4 @@ const struct child_configuration child_configuration[CHILDREN_COUNT] = {
     }
 };
 
-
-
+#endif
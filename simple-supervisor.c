@@ -14,19 +14,128 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifdef __linux__
+// for splice()
+#define _GNU_SOURCE
+#endif
+
+#include <arpa/inet.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
 #include <poll.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
-// this can safely be adjusted upwards if necessary
+// these can safely be adjusted upwards if necessary
 #define MAX_CHILD_COMMAND_ARGUMENT_COUNT 20
+#define MAX_CHILD_DEPENDENCY_COUNT 8
+#define MAX_CHILD_LISTEN_COUNT 4
+
+#ifdef SUPERVISOR_BENCHMARK
+// what the lines of a synthetic child are made of: plain ASCII, multi-byte
+// UTF-8, or text with a tab or escape sequence every few bytes
+#define BENCH_CONTENT_ASCII 0
+#define BENCH_CONTENT_UTF8 1
+#define BENCH_CONTENT_CONTROL 2
+
+// describes a synthetic child in the benchmark build, see bench.h
+struct benchmark_profile {
+    long lines_per_second;
+    // in bytes, including the line feed
+    long line_length;
+    // lines handed to each write()
+    long burst;
+    int content;
+};
+#endif
+
+#define PROBE_NONE 0
+#define PROBE_TCP 1
+#define PROBE_UNIX 2
+#define PROBE_HTTP 3
+#define PROBE_FILE 4
+
+// a check made from the event loop, without starting a process
+struct probe_configuration {
+    // PROBE_NONE, PROBE_TCP, PROBE_UNIX, PROBE_HTTP or PROBE_FILE
+    int kind;
+    // "address:port" for TCP and HTTP, where the address is numeric and an
+    // IPv6 one is written in brackets, and a path for UNIX and FILE
+    const char *target;
+    // for HTTP, what is asked for and the status to pass with; "/" and 200
+    // unless set
+    const char *path;
+    int status;
+    // in milliseconds; PROBE_INTERVAL and PROBE_TIMEOUT unless set
+    int interval;
+    int timeout;
+    // failures in a row that count as the probe failing; PROBE_FAILURES
+    // unless set
+    int failures;
+};
+
+#define LIMIT_ZERO -1
+#define LIMIT_UNLIMITED -2
+
+#define IO_CLASS_REALTIME 1
+#define IO_CLASS_BEST_EFFORT 2
+#define IO_CLASS_IDLE 3
+
+// applied to a child between fork and exec, so that it cannot take more than
+// its share from the others; what is left at 0 is inherited
+struct resource_configuration {
+    // in bytes; LIMIT_ZERO sets a limit to 0 and LIMIT_UNLIMITED lifts it,
+    // for both the soft and the hard limit
+    long long address_space;
+    long long open_files;
+    long long core;
+    // the niceness to run with
+    int nice;
+    // IO_CLASS_REALTIME, IO_CLASS_BEST_EFFORT or IO_CLASS_IDLE, with a level
+    // from 0, the most favoured, to 7; Linux only
+    int io_class;
+    int io_level;
+    // a cgroup v2 group made beside the supervisor's own, NAME.k for each
+    // instance, and what goes in its cpu.max and memory.max, such as
+    // "50000 100000" and "512M"; Linux only
+    const char *cgroup;
+    const char *cpu_max;
+    const char *memory_max;
+};
+
+// how much output of a child is let through before lines are dropped; a
+// limit of 0 is none
+struct rate_limit_configuration {
+    long lines_per_second;
+    long bytes_per_second;
+    // set to let every sample-th line over the limit through anyway
+    int sample;
+};
 
 struct child_configuration {
     char *command[MAX_CHILD_COMMAND_ARGUMENT_COUNT + 1];
@@ -35,37 +144,628 @@ struct child_configuration {
     int receives_sigusr2;
     int termination_signal;
     int is_startup_check;
+    // names of children that must succeed (startup checks) or have been
+    // started (everything else) first; when empty, a normal child waits for
+    // every startup check and a startup check waits for nothing
+    const char *depends_on[MAX_CHILD_DEPENDENCY_COUNT + 1];
+    // output is copied through untouched, without prefixes or scrubbing
+    int passthrough;
+    // RESTART_NEVER, RESTART_ON_FAILURE or RESTART_ALWAYS
+    int restart;
+    // children are stopped in waves of ascending shutdown_order, each wave
+    // once every child of the previous one has exited
+    int shutdown_order;
+    // in seconds, before the child is killed; 0 means SHUTDOWN_TIMEOUT
+    int shutdown_timeout;
+    // path that both streams are appended to instead of the supervisor's
+    // stdout and stderr; children naming the same path share the file
+    const char *log_file;
+    // set to also take lines from a shared memory ring the child writes to
+    // directly, see README.md
+    int log_ring;
+    // dependents of a child with a probe wait for it to pass, after which
+    // failing it gets the child stopped, to be restarted as its policy says;
+    // a startup check with a probe and no command passes or fails by the
+    // probe alone
+    struct probe_configuration probe;
+    // sockets bound once at startup and handed to every run of the child as
+    // LISTEN_FDS, so connections wait in the backlog across restarts; each
+    // is "address:port" like a probe target, or a UNIX socket path, which
+    // has a slash in it
+    const char *listen[MAX_CHILD_LISTEN_COUNT + 1];
+    // copies of the child that are run side by side, as NAME.1 to NAME.n,
+    // sharing its listen sockets and counting as one dependency that is
+    // satisfied once all of them are; 0 means 1, and INSTANCES_COUNT in
+    // config.h has to add up those of every child
+    int instances;
+    // CPUs to keep every instance to, as a list like "0-3,8", and NUMA nodes
+    // whose CPUs to keep them to, as a list like "1"; memory then comes from
+    // those nodes by the kernel's default policy of allocating locally; set
+    // pin_instances to give each instance just one CPU of the set in turn;
+    // only Linux can do this, elsewhere it is ignored
+    const char *cpus;
+    const char *numa_nodes;
+    int pin_instances;
+    struct resource_configuration resources;
+    // counts stdout, stderr and the log ring together; output that is
+    // passed through is not limited
+    struct rate_limit_configuration rate_limit;
+#ifdef SUPERVISOR_BENCHMARK
+    struct benchmark_profile benchmark;
+#endif
 };
 
+#define OUTPUT_FLUSH_PER_LINE 0
+#define OUTPUT_FLUSH_PER_ITERATION 1
+
+#define LONG_LINE_SPLIT 0
+#define LONG_LINE_TRUNCATE 1
+#define LONG_LINE_PASSTHROUGH 2
+
+#define TIMESTAMP_NONE 0
+#define TIMESTAMP_ISO8601 1
+#define TIMESTAMP_EPOCH_MS 2
+
+#define OUTPUT_FORMAT_PLAIN 0
+#define OUTPUT_FORMAT_JSON 1
+#define OUTPUT_FORMAT_LOGFMT 2
+
+#define OUTPUT_OVERFLOW_BLOCK 0
+#define OUTPUT_OVERFLOW_DROP_OLDEST 1
+#define OUTPUT_OVERFLOW_DROP_MARKED 2
+
+#define RESTART_NEVER 0
+#define RESTART_ON_FAILURE 1
+#define RESTART_ALWAYS 2
+
+// SIGINFO is what ^T sends on the BSDs, and Linux has SIGPWR spare instead
+#ifdef SIGINFO
+#define STATS_SIGNAL_DEFAULT SIGINFO
+#else
+#define STATS_SIGNAL_DEFAULT SIGPWR
+#endif
+
+#define EVENT_BACKEND_DEFAULT 0
+#define EVENT_BACKEND_POLL 1
+#define EVENT_BACKEND_EPOLL 2
+#define EVENT_BACKEND_KQUEUE 3
+
 #include "config.h"
 
-#define PHASE_CHECK 0
-#define PHASE_NORMAL 1
+// every instance of every child has a slot; config.h says how many there are
+// once some child has more than one
+#ifndef INSTANCES_COUNT
+#define INSTANCES_COUNT CHILDREN_COUNT
+#endif
+
+#if EVENT_BACKEND == EVENT_BACKEND_DEFAULT
+#undef EVENT_BACKEND
+#if defined(__linux__)
+#define EVENT_BACKEND EVENT_BACKEND_EPOLL
+#elif defined(__OpenBSD__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__DragonFly__) || defined(__APPLE__)
+#define EVENT_BACKEND EVENT_BACKEND_KQUEUE
+#else
+#define EVENT_BACKEND EVENT_BACKEND_POLL
+#endif
+#endif
+
+#ifdef __OpenBSD__
+// children pledge themselves between fork() and exec, which posix_spawn() cannot do
+#undef USE_POSIX_SPAWN
+#define USE_POSIX_SPAWN 0
+#endif
+
+#if !SCALAR_LINE_SCANNER && defined(__SSE2__)
+#include <emmintrin.h>
+#elif !SCALAR_LINE_SCANNER && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if EVENT_BACKEND == EVENT_BACKEND_EPOLL
+#include <sys/epoll.h>
+#elif EVENT_BACKEND == EVENT_BACKEND_KQUEUE
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#if IO_WORKERS > 0
+#include <pthread.h>
+#include <sched.h>
+// the event loop, stream buffers and line handling keep their state per
+// thread, so that every worker runs a copy of them on its own
+#define THREAD_LOCAL _Thread_local
+#else
+#define THREAD_LOCAL
+#endif
+
+#if IO_WORKERS > 0 && (IO_WORKER_RING_SIZE & (IO_WORKER_RING_SIZE - 1)) != 0
+#error "IO_WORKER_RING_SIZE must be a power of two"
+#endif
+
+#if (LOG_RING_SIZE & (LOG_RING_SIZE - 1)) != 0
+#error "LOG_RING_SIZE must be a power of two"
+#endif
+
+#if RELOAD_BATCH_SIZE < 1
+#error "RELOAD_BATCH_SIZE must be at least 1"
+#endif
+
+// every line takes three entries: prefix, body and line end, plus one for
+// the timestamp if there is one
+#define OUTPUT_IOVECS_PER_LINE (TIMESTAMP_FORMAT == TIMESTAMP_NONE ? 3 : 4)
+
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define OUTPUT_IOV_COUNT (IOV_MAX - IOV_MAX % OUTPUT_IOVECS_PER_LINE)
+#else
+#define OUTPUT_IOV_COUNT 1020
+#endif
+
+// structured lines open their message in the prefix and close it at the end;
+// a timestamp comes first, so with JSON it opens the object as well
+#if OUTPUT_FORMAT == OUTPUT_FORMAT_JSON
+#define LINE_END "\"}\n"
+#define CLOCK_OPEN (TIMESTAMP_FORMAT == TIMESTAMP_ISO8601 ? "{\"ts\":\"" : "{\"ts\":")
+#define CLOCK_CLOSE (TIMESTAMP_FORMAT == TIMESTAMP_ISO8601 ? "\"," : ",")
+#elif OUTPUT_FORMAT == OUTPUT_FORMAT_LOGFMT
+#define LINE_END "\"\n"
+#define CLOCK_OPEN "ts="
+#define CLOCK_CLOSE " "
+#else
+#define LINE_END "\n"
+#define CLOCK_OPEN ""
+#define CLOCK_CLOSE " "
+#endif
+
+#define LINE_END_LENGTH (sizeof(LINE_END) - 1)
+
+// structured formats escape quotes and backslashes, which can double a line
+#define SCRUB_ESCAPES (OUTPUT_FORMAT != OUTPUT_FORMAT_PLAIN)
+#define SCRUB_EXPANSION (SCRUB_ESCAPES ? 2 : 1)
+
+#define FLAVOUR_SIGNAL (-1)
+#define FLAVOUR_STDOUT (1)
+#define FLAVOUR_STDERR (2)
+#define FLAVOUR_OUTPUT (3)
+#define FLAVOUR_METRICS_LISTENER (4)
+#define FLAVOUR_METRICS_CONNECTION (5)
+#define FLAVOUR_WORKER (6)
+#define FLAVOUR_WAKE (7)
+#define FLAVOUR_RING (8)
+#define FLAVOUR_PROBE (9)
+
+#define EVENT_READ 1
+#define EVENT_WRITE 2
+
+// one of these is registered with the event backend per watched descriptor
+struct event_source {
+    int fd;
+    int flavour;
+    // EVENT_READ or EVENT_WRITE, whichever readiness is waited for
+    int events;
+    // backend slot, or -1 while not registered
+    int index;
+    int revents;
+    void *object;
+};
+
+struct buffer;
+struct log_file;
+struct ring;
+struct worker;
+
+struct output {
+#ifdef SUPERVISOR_BENCHMARK
+    // when each staged line was written by its child, or 0 if unknown; a
+    // line takes at least two entries, its prefix and some text
+    int bench_line_count;
+    uint64_t bench_stamps[OUTPUT_IOV_COUNT / 2 + 1];
+#endif
+    int fd;
+    // a stream in the middle of passing through an overlong line, and the
+    // streams held back until it ends
+    struct buffer *owner;
+    struct buffer *paused;
+    // cleared once splice() has refused this destination
+    int splice_usable;
+    // descriptor flags to restore on exit, or -1
+    int original_flags;
+    // set from when the queue passes half full until it drains to a quarter,
+    // while OUTPUT_OVERFLOW_BLOCK holds producers back
+    int congested;
+    // set if the destination has received part of a line but not its end
+    int line_open;
+    unsigned long long lines_dropped;
+    // dropped lines not yet reported by a marker line
+    unsigned long long lines_unreported;
+    // registered for EVENT_WRITE while the queue holds anything
+    struct event_source source;
+    // set for log files, whose flushes go to their write buffer instead
+    struct log_file *log;
+    // set for the outputs of workers, whose flushes go to the main thread
+    struct ring *ring;
+    struct worker *worker;
+    int iov_count;
+    size_t used;
+    struct iovec iov[OUTPUT_IOV_COUNT];
+    char data[OUTPUT_BATCH_SIZE];
+    // what the destination would not take yet, from queue_head to queue_tail,
+    // in OUTPUT_QUEUE_SIZE bytes that only outputs with a descriptor have
+    size_t queue_head;
+    size_t queue_tail;
+    char *queue;
+};
+
+// upper bound on reads from one pipe per wakeup, so a single busy child
+// cannot starve the others
+#define STREAM_READS_PER_WAKEUP 16
+
+// stream buffers grow to hold a full line with as much room again for the next read
+#if STREAM_BUFFER_SIZE > 2 * MAX_LINE_LENGTH
+#define STREAM_BUFFER_LIMIT STREAM_BUFFER_SIZE
+#else
+#define STREAM_BUFFER_LIMIT (2 * MAX_LINE_LENGTH)
+#endif
+
+struct stream_stats {
+    unsigned long long bytes;
+    unsigned long long lines;
+    // lines longer than MAX_LINE_LENGTH, whatever LONG_LINE_POLICY did with them
+    unsigned long long long_lines;
+    unsigned long long reads;
+    // dropped for being over the child's rate limit
+    unsigned long long rate_limited;
+};
+
+// what starts each line of a stream, such as "[NAME] ", built once so that
+// lines are prefixed without formatting
+struct line_prefix {
+    const char *text;
+    size_t length;
+};
 
 struct buffer {
-    char buffer[MAX_LINE_LENGTH + 1];
+    // allocated from the slabs on first use and released when closed
+    char *buffer;
+    size_t capacity;
     size_t position;
-    int destination_fd;
-    int source_fd;
+    // set while the rest of an overlong line is being dropped or passed through
+    int overflow;
+    // set once the current line has been counted as long
+    int long_line;
+    // set while the rest of a line over the rate limit is being dropped
+    int dropping;
+    struct stream_stats stats;
+    int paused;
+    struct buffer *next_paused;
+    struct output *destination;
+    struct line_prefix prefix;
+    struct event_source source;
+};
+
+// a deadline in the timer wheel; expire is called once it has passed
+struct timer {
+    struct timer *next;
+    struct timer **link;
+    // the wheel slot it is linked into, as level * TIMER_SLOTS + slot
+    int bucket;
+    uint64_t expires;
+    void (*expire)(struct timer *timer);
+    void *object;
+};
+
+// how a log ring starts, in memory shared with the child; the child appends
+// at tail and the supervisor takes from head, both counting bytes written so
+// far, so that data is used from the start again once it has been filled
+struct log_ring {
+    uint64_t size;
+    char size_line[56];
+    _Atomic uint64_t head;
+    // set by the supervisor when it has found the ring empty, and cleared by
+    // the child when it rings the doorbell
+    _Atomic uint32_t waiting;
+    char head_line[52];
+    _Atomic uint64_t tail;
+    char tail_line[56];
+    char data[LOG_RING_SIZE];
+};
+
+// where a child sees its listen sockets, as sd_listen_fds() expects them,
+// followed by its log ring and the doorbell for it
+#define LISTEN_FDS_START 3
+#define CHILD_DESCRIPTORS_END (LISTEN_FDS_START + MAX_CHILD_LISTEN_COUNT + 2)
+
+// what start_child hands over to whichever thread reads the child's output
+struct child_streams {
+    int out_fd;
+    int err_fd;
+    // the log ring and both ends of its doorbell, if the child has one
+    struct log_ring *ring;
+    int doorbell_r;
+    int doorbell_w;
+};
+
+// a scraper or probed service hanging up early must not take the supervisor
+// down with SIGPIPE, which is left alone otherwise, as children inherit its
+// disposition
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define PROBE_IDLE 0
+#define PROBE_CONNECTING 1
+#define PROBE_RECEIVING 2
+
+struct probe_state {
+    // runs out once it is time for the next attempt, or the current one has
+    // taken too long
+    struct timer timer;
+    struct event_source source;
+    // PROBE_IDLE between attempts
+    int phase;
+    // set from when probing starts until it is given up
+    int active;
+    // set once an attempt has passed
+    int passed;
+    int failures;
+    struct sockaddr_storage address;
+    socklen_t address_length;
+    // enough of an HTTP response for its status
+    size_t received;
+    char response[16];
+};
+
+#define RELOAD_NONE 0
+// waiting for its turn in a reload
+#define RELOAD_PENDING 1
+// asked to exit, so as to be started again
+#define RELOAD_STOPPING 2
+// started again, but yet to pass its probe
+#define RELOAD_STARTING 3
+
+// token buckets, refilled as lines are read; they may run into debt by the
+// one line that empties them
+struct rate_limit_state {
+    double lines;
+    double bytes;
+    uint64_t refilled_at;
+    // lines over the limit, for sampling
+    unsigned long long over;
+    // dropped lines already reported
+    unsigned long long reported;
 };
 
 struct child_state {
     struct buffer out_buffer;
     struct buffer err_buffer;
+    // lines from the log ring, handled like those of stdout
+    struct buffer ring_buffer;
+    struct log_ring *ring;
+    // how far the ring has been taken, kept apart from what the child can change
+    uint64_t ring_head;
+    // the supervisor's own end of the doorbell, rung when it leaves data behind
+    int ring_doorbell;
+    struct probe_state probe;
+    // bound for as long as the supervisor runs
+    int listen_fds[MAX_CHILD_LISTEN_COUNT];
+    int listen_count;
+    // NAME.k for an instance of a child with more than one
+    const char *name;
+    int instance;
+#ifdef __linux__
+    cpu_set_t cpus;
+#endif
+    int pinned;
+    // cgroup.procs of the child's group, which it adds itself to
+    int cgroup_fd;
+    struct rate_limit_state rate;
     pid_t pid;
     int running;
+    int started;
+    // set once dependents of this child may be started
+    int satisfied;
+    int waits_for_checks;
+    int dependency_count;
+    // indices into child_configuration
+    int dependencies[MAX_CHILD_DEPENDENCY_COUNT];
+    // armed while the child waits out its restart backoff
+    struct timer restart_timer;
+    // set once the child has been asked to exit, armed until it has
+    int stopping;
+    struct timer stop_timer;
+    // RELOAD_NONE unless a reload has yet to finish with the child
+    int reload;
+    uint64_t started_at;
+    // consecutive quick restarts, which make the next backoff longer
+    int backoff_steps;
+    uint64_t window_started_at;
+    int window_restarts;
+    // wait status of the last exit, valid once has_exited is set
+    int has_exited;
+    int exit_status;
+    unsigned long long restarts;
+    // event loop wakeups that found a stream of this child ready
+    unsigned long long wakeups;
+    // where both streams go instead of stdout and stderr, if anywhere
+    struct log_file *log;
     const struct child_configuration *config;
 };
 
-struct child_state children[CHILDREN_COUNT];
+struct child_state children[INSTANCES_COUNT];
+
+// a file some children write to instead of stdout and stderr; lines are
+// staged in an output of its own as usual, and each flush of that lands in a
+// write buffer that is only written out when full or on a timer
+struct log_file {
+    const char *path;
+    int fd;
+    // bytes in the current file, for rotation by size
+    uint64_t size;
+    // in milliseconds, for rotation by age
+    uint64_t opened_at;
+    // written to since the last fdatasync()
+    int dirty;
+    // set when the buffer ends partway through a line, which defers rotation
+    int line_open;
+    // set once a failed write has been reported, until one succeeds
+    int failing;
+    size_t used;
+    char *buffer;
+    struct output *output;
+    // index into destinations
+    int destination;
+};
+
+struct log_file log_files[CHILDREN_COUNT];
+int log_file_count;
+struct timer log_flush_timer;
+struct timer log_sync_timer;
+
+struct line_prefix system_prefix;
+struct line_prefix stats_prefix;
+
+// the timestamp prefix shared by every line handled in one loop iteration;
+// staged output is flushed before the next iteration updates it, so lines
+// can point at it rather than copy it
+struct line_clock {
+    long long millisecond;
+    time_t second;
+    // where the milliseconds go, after the part formatted once a second
+    size_t second_length;
+    char text[48];
+    size_t length;
+};
+
+THREAD_LOCAL struct line_clock line_clock = { .millisecond = -1, .second = -1 };
+
+char output_stdout_queue[OUTPUT_QUEUE_SIZE];
+char output_stderr_queue[OUTPUT_QUEUE_SIZE];
+
+struct output output_stdout = {
+    .fd = STDOUT_FILENO,
+    .queue = &output_stdout_queue[0],
+    .splice_usable = 1,
+    .original_flags = -1,
+    .source = { .fd = STDOUT_FILENO, .flavour = FLAVOUR_OUTPUT, .events = EVENT_WRITE, .index = -1, .object = &output_stdout }
+};
+struct output output_stderr = {
+    .fd = STDERR_FILENO,
+    .queue = &output_stderr_queue[0],
+    .splice_usable = 1,
+    .original_flags = -1,
+    .source = { .fd = STDERR_FILENO, .flavour = FLAVOUR_OUTPUT, .events = EVENT_WRITE, .index = -1, .object = &output_stderr }
+};
+
+// stdout, stderr and then every log file; workers have outputs of their own
+// for each of these
+struct output *destinations[2 + CHILDREN_COUNT] = { &output_stdout, &output_stderr };
+int destination_count = 2;
+
+// metrics scrapes served at the same time; further ones wait in the backlog
+#define METRICS_CONNECTION_COUNT 8
+
+// the signal pipe, both output pipes, the log ring doorbell and the probe of
+// every child, both destinations, the metrics socket with its connections
+// and the doorbell of every worker
+#define EVENT_SOURCE_COUNT (INSTANCES_COUNT * 4 + 4 + METRICS_CONNECTION_COUNT + IO_WORKERS)
+
+struct event_source signal_source = { .fd = -1, .flavour = FLAVOUR_SIGNAL, .events = EVENT_READ, .index = -1 };
+THREAD_LOCAL struct event_source *event_ready[EVENT_SOURCE_COUNT];
+THREAD_LOCAL int event_ready_count;
 
 int signal_r;
 int signal_w;
 int teardown_in_progress;
+int reload_in_progress;
+int checks_pending;
+int normal_pending;
+// set if some child may have to be executed again after startup
+int restarts_configured;
 volatile sig_atomic_t termination_signal_received;
 volatile sig_atomic_t sigusr1_received;
 volatile sig_atomic_t sigusr2_received;
-volatile sig_atomic_t sigalrm_received;
+volatile sig_atomic_t stats_requested;
+volatile sig_atomic_t reload_requested;
+
+unsigned long long loop_iterations;
+unsigned long long loop_wakeups;
+// time spent handling each wakeup, and how late timers expire
+struct histogram loop_busy;
+struct histogram timer_lateness;
+// bumped by every loop iteration that may have changed a counter
+unsigned long long stats_generation;
+
+__attribute__((format(printf, 1, 2)))
+void system_message(const char *format, ...);
+void finish_outputs();
+
+uint64_t monotonic_ns() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// log-linear buckets, sixteen per power of two, so any value is known to
+// within about six percent
+#define HISTOGRAM_BUCKET_COUNT (16 * 61)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKET_COUNT];
+};
+
+void histogram_merge(struct histogram *into, const struct histogram *from) {
+    for(int i = 0; i < HISTOGRAM_BUCKET_COUNT; i += 1) {
+        into->buckets[i] += from->buckets[i];
+    }
+
+    into->count += from->count;
+    into->sum += from->sum;
+
+    if(from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+void histogram_record(struct histogram *histogram, uint64_t value) {
+    int bucket = value;
+
+    if(value >= 16) {
+        int exponent = 63 - __builtin_clzll(value);
+        bucket = (exponent - 3) * 16 + ((value >> (exponent - 4)) & 15);
+    }
+
+    histogram->buckets[bucket] += 1;
+    histogram->count += 1;
+    histogram->sum += value;
+
+    if(value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+// returns the lower bound of the bucket holding the given percentile
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile) {
+    uint64_t target = histogram->count * percentile / 100.0;
+    uint64_t seen = 0;
+
+    for(int bucket = 0; bucket < HISTOGRAM_BUCKET_COUNT; bucket += 1) {
+        seen += histogram->buckets[bucket];
+
+        if(seen > target) {
+            if(bucket < 16) {
+                return bucket;
+            }
+            return (uint64_t)(16 + bucket % 16) << (bucket / 16 - 1);
+        }
+    }
+
+    return histogram->max;
+}
 
 void signal_handler(int signum) {
     if(signum == SIGTERM || signum == SIGINT) {
@@ -74,515 +774,5583 @@ void signal_handler(int signum) {
         sigusr1_received = 1;
     } else if(signum == SIGUSR2) {
         sigusr2_received = 1;
-    } else if(signum == SIGALRM) {
-        sigalrm_received = 1;
+    } else if(signum == STATS_SIGNAL) {
+        stats_requested = 1;
+    } else if(signum == SIGHUP) {
+        reload_requested = 1;
     }
 
     char buffer = 'X';
     write(signal_w, &buffer, 1);
 }
 
-__attribute__((noreturn))
-void execute(const struct child_configuration *configuration, int p_in, int p_out, int p_err) {
-#ifdef __OpenBSD__
-    if(pledge("stdio exec", NULL) == -1) {
-        err(1, "pledge()");
+void event_ready_add(struct event_source *source, int revents) {
+    if(source->revents == 0) {
+        event_ready[event_ready_count] = source;
+        event_ready_count += 1;
+    }
+
+    source->revents |= revents;
+}
+
+#if EVENT_BACKEND == EVENT_BACKEND_EPOLL
+
+THREAD_LOCAL int epoll_fd;
+THREAD_LOCAL struct epoll_event epoll_events[EVENT_SOURCE_COUNT];
+
+void event_init() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if(epoll_fd == -1) {
+        err(1, "epoll_create1()");
+    }
+}
+
+int event_add(struct event_source *source) {
+    struct epoll_event event;
+
+    bzero(&event, sizeof(struct epoll_event));
+    event.events = (source->events == EVENT_WRITE) ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = source;
+
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->fd, &event) == -1) {
+        warn("epoll_ctl(..., EPOLL_CTL_ADD, %i, ...)", source->fd);
+        return -1;
+    }
+
+    source->index = 0;
+    return 0;
+}
+
+void event_remove(struct event_source *source) {
+    // explicit removal matters, as a forked child may still share the file
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL) == -1) {
+        warn("epoll_ctl(..., EPOLL_CTL_DEL, %i, ...)", source->fd);
+    }
+}
+
+int event_backend_wait(int timeout) {
+    int count = epoll_wait(epoll_fd, &epoll_events[0], EVENT_SOURCE_COUNT, timeout);
+
+    if(count == -1) {
+        if(errno != EINTR) {
+            warn("epoll_wait()");
+        }
+        return -1;
+    }
+
+    for(int i = 0; i < count; i += 1) {
+        struct event_source *source = epoll_events[i].data.ptr;
+
+        // errors and hangups are reported so that the next call notices them
+        if(epoll_events[i].events & (EPOLLIN | EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+            event_ready_add(source, source->events);
+        }
+    }
+
+    return event_ready_count;
+}
+
+#elif EVENT_BACKEND == EVENT_BACKEND_KQUEUE
+
+THREAD_LOCAL int kqueue_fd;
+THREAD_LOCAL struct kevent kqueue_events[EVENT_SOURCE_COUNT];
+
+void event_init() {
+    kqueue_fd = kqueue();
+
+    if(kqueue_fd == -1) {
+        err(1, "kqueue()");
+    }
+}
+
+int event_add(struct event_source *source) {
+    struct kevent change;
+
+    EV_SET(&change, source->fd, (source->events == EVENT_WRITE) ? EVFILT_WRITE : EVFILT_READ, EV_ADD, 0, 0, source);
+
+    if(kevent(kqueue_fd, &change, 1, NULL, 0, NULL) == -1) {
+        warn("kevent(..., EV_ADD) for %i", source->fd);
+        return -1;
+    }
+
+    source->index = 0;
+    return 0;
+}
+
+void event_remove(struct event_source *source) {
+    struct kevent change;
+
+    EV_SET(&change, source->fd, (source->events == EVENT_WRITE) ? EVFILT_WRITE : EVFILT_READ, EV_DELETE, 0, 0, NULL);
+
+    if(kevent(kqueue_fd, &change, 1, NULL, 0, NULL) == -1) {
+        warn("kevent(..., EV_DELETE) for %i", source->fd);
+    }
+}
+
+int event_backend_wait(int timeout) {
+    struct timespec ts;
+    struct timespec *tsp = NULL;
+
+    if(timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        tsp = &ts;
+    }
+
+    int count = kevent(kqueue_fd, NULL, 0, &kqueue_events[0], EVENT_SOURCE_COUNT, tsp);
+
+    if(count == -1) {
+        if(errno != EINTR) {
+            warn("kevent()");
+        }
+        return -1;
+    }
+
+    for(int i = 0; i < count; i += 1) {
+        // EV_EOF arrives on the filter itself, so a closed pipe still reads as ready
+        if(kqueue_events[i].filter == EVFILT_READ) {
+            event_ready_add(kqueue_events[i].udata, EVENT_READ);
+        } else if(kqueue_events[i].filter == EVFILT_WRITE) {
+            event_ready_add(kqueue_events[i].udata, EVENT_WRITE);
+        }
+    }
+
+    return event_ready_count;
+}
+
+#else
+
+// kept across loop iterations; entries are only added or removed when a
+// descriptor is opened or closed, and removal swaps in the last entry
+struct poll_data {
+    nfds_t count;
+    struct pollfd entry[EVENT_SOURCE_COUNT];
+    struct event_source *source[EVENT_SOURCE_COUNT];
+};
+
+THREAD_LOCAL struct poll_data poll_data;
+
+void event_init() {
+}
+
+int event_add(struct event_source *source) {
+    nfds_t index = poll_data.count;
+
+    if(index == EVENT_SOURCE_COUNT) {
+        warnx("too many descriptors to poll");
+        return -1;
+    }
+
+    poll_data.entry[index].fd = source->fd;
+    poll_data.entry[index].events = (source->events == EVENT_WRITE) ? POLLOUT : POLLIN;
+    poll_data.entry[index].revents = 0;
+    poll_data.source[index] = source;
+    poll_data.count += 1;
+
+    source->index = index;
+    return 0;
+}
+
+void event_remove(struct event_source *source) {
+    nfds_t index = source->index;
+    nfds_t last = poll_data.count - 1;
+
+    if(index != last) {
+        poll_data.entry[index] = poll_data.entry[last];
+        poll_data.source[index] = poll_data.source[last];
+        poll_data.source[index]->index = index;
+    }
+
+    poll_data.count -= 1;
+}
+
+int event_backend_wait(int timeout) {
+    int count = poll(&poll_data.entry[0], poll_data.count, timeout);
+
+    if(count == -1) {
+        if(errno != EINTR) {
+            warn("poll()");
+        }
+        return -1;
+    }
+
+    for(nfds_t i = 0; i < poll_data.count && count > 0; i += 1) {
+        if(poll_data.entry[i].revents == 0) {
+            continue;
+        }
+
+        if(poll_data.entry[i].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)) {
+            event_ready_add(poll_data.source[i], poll_data.source[i]->events);
+        }
+
+        count -= 1;
     }
+
+    return event_ready_count;
+}
+
 #endif
 
-    if(dup2(p_in, STDIN_FILENO) == -1) {
-        err(1, "dup2() for stdin");
+void event_remove_source(struct event_source *source) {
+    if(source->index == -1) {
+        return;
+    }
+
+    event_remove(source);
+
+    // a source closed while handling this batch must not be handled later
+    source->revents = 0;
+    source->index = -1;
+}
+
+int event_wait(int timeout) {
+    for(int i = 0; i < event_ready_count; i += 1) {
+        event_ready[i]->revents = 0;
+    }
+
+    event_ready_count = 0;
+
+    return event_backend_wait(timeout);
+}
+
+struct buffer *buffer_for_flavour(struct child_state *child, int flavour) {
+    if(flavour == FLAVOUR_RING) {
+        return &child->ring_buffer;
+    }
+
+    return (flavour == FLAVOUR_STDOUT) ? &child->out_buffer : &child->err_buffer;
+}
+
+// where a stream of the child goes, as an index into destinations
+int destination_of(const struct child_state *child, int flavour) {
+    if(child->log != NULL) {
+        return child->log->destination;
+    }
+
+    return (flavour == FLAVOUR_STDERR) ? 1 : 0;
+}
+
+// hierarchical timer wheel with millisecond ticks: level 0 holds timers due
+// within 64 ticks, and each level above covers 64 times the span of the one
+// below; slots are cascaded downwards as the wheel turns past them, which
+// keeps setting, cancelling and expiring a timer O(1)
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_SPAN ((uint64_t)1 << (TIMER_LEVELS * TIMER_SLOT_BITS))
+
+struct timer *timer_slots[TIMER_LEVELS][TIMER_SLOTS];
+uint64_t timer_occupied[TIMER_LEVELS];
+// the last tick that has been processed
+uint64_t timer_now;
+
+uint64_t timer_ticks() {
+    return monotonic_ns() / 1000000;
+}
+
+void timer_init() {
+    timer_now = timer_ticks();
+}
+
+int timer_armed(const struct timer *timer) {
+    return timer->link != NULL;
+}
+
+void timer_place(struct timer *timer) {
+    uint64_t expires = timer->expires;
+
+    // far off timers wait in the last slot and are placed again on cascade
+    if(expires - timer_now >= TIMER_SPAN) {
+        expires = timer_now + TIMER_SPAN - 1;
+    }
+
+    int level = 0;
+
+    while(level < TIMER_LEVELS - 1 && expires - timer_now >= (uint64_t)1 << ((level + 1) * TIMER_SLOT_BITS)) {
+        level += 1;
+    }
+
+    int slot = (expires >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1);
+    struct timer **head = &timer_slots[level][slot];
+
+    timer->next = *head;
+    timer->link = head;
+    timer->bucket = level * TIMER_SLOTS + slot;
+
+    if(*head != NULL) {
+        (*head)->link = &timer->next;
+    }
+
+    *head = timer;
+    timer_occupied[level] |= (uint64_t)1 << slot;
+}
+
+void timer_cancel(struct timer *timer) {
+    if(!timer_armed(timer)) {
+        return;
+    }
+
+    *timer->link = timer->next;
+
+    if(timer->next != NULL) {
+        timer->next->link = timer->link;
+    }
+
+    int level = timer->bucket / TIMER_SLOTS;
+    int slot = timer->bucket % TIMER_SLOTS;
+
+    if(timer_slots[level][slot] == NULL) {
+        timer_occupied[level] &= ~((uint64_t)1 << slot);
+    }
+
+    timer->link = NULL;
+    timer->next = NULL;
+}
+
+// arms the timer to expire after at least the given number of milliseconds
+void timer_set(struct timer *timer, uint64_t delay) {
+    timer_cancel(timer);
+
+    timer->expires = timer_ticks() + delay;
+
+    // the current tick has been processed already
+    if(timer->expires <= timer_now) {
+        timer->expires = timer_now + 1;
+    }
+
+    timer_place(timer);
+}
+
+// takes the timers out of a slot, leaving them unlinked in a list
+struct timer *timer_take_slot(int level, int slot) {
+    struct timer *list = timer_slots[level][slot];
+
+    timer_slots[level][slot] = NULL;
+    timer_occupied[level] &= ~((uint64_t)1 << slot);
+
+    for(struct timer *timer = list; timer != NULL; timer = timer->next) {
+        timer->link = NULL;
+    }
+
+    return list;
+}
+
+// expires every timer that is due by now
+void timer_run() {
+    uint64_t target = timer_ticks();
+
+    while(timer_now < target) {
+        // nothing is due before the next cascade while level 0 is empty
+        if(timer_occupied[0] == 0) {
+            uint64_t boundary = (timer_now | (TIMER_SLOTS - 1)) + 1;
+
+            if(boundary > target) {
+                timer_now = target;
+                break;
+            }
+
+            timer_now = boundary;
+        } else {
+            timer_now += 1;
+        }
+
+        for(int level = 1; level < TIMER_LEVELS; level += 1) {
+            if((timer_now & (((uint64_t)1 << (level * TIMER_SLOT_BITS)) - 1)) != 0) {
+                break;
+            }
+
+            struct timer *timer = timer_take_slot(level, (timer_now >> (level * TIMER_SLOT_BITS)) & (TIMER_SLOTS - 1));
+
+            while(timer != NULL) {
+                struct timer *next = timer->next;
+
+                timer_place(timer);
+                timer = next;
+            }
+        }
+
+        int slot = timer_now & (TIMER_SLOTS - 1);
+
+        // expire one at a time, as a callback may cancel or set other timers
+        while(timer_slots[0][slot] != NULL) {
+            struct timer *timer = timer_slots[0][slot];
+
+            timer_cancel(timer);
+            histogram_record(&timer_lateness, monotonic_ns() - timer->expires * 1000000);
+            timer->expire(timer);
+        }
+    }
+}
+
+// returns the poll timeout in milliseconds until the wheel next needs to
+// run, which for a higher level is when its nearest slot is cascaded
+int timer_timeout() {
+    uint64_t next = 0;
+
+    for(int level = 0; level < TIMER_LEVELS; level += 1) {
+        if(timer_occupied[level] == 0) {
+            continue;
+        }
+
+        int shift = level * TIMER_SLOT_BITS;
+        int cursor = (timer_now >> shift) & (TIMER_SLOTS - 1);
+        uint64_t occupied = timer_occupied[level];
+        // rotate so that bit 0 is the slot after the cursor, and the slot
+        // under the cursor comes last, a whole turn away
+        uint64_t rotated = occupied;
+
+        if(cursor != TIMER_SLOTS - 1) {
+            rotated = (occupied >> (cursor + 1)) | (occupied << (TIMER_SLOTS - 1 - cursor));
+        }
+
+        uint64_t distance = __builtin_ctzll(rotated) + 1;
+        uint64_t tick = ((timer_now >> shift) + distance) << shift;
+
+        if(next == 0 || tick < next) {
+            next = tick;
+        }
+    }
+
+    if(next == 0) {
+        return -1;
+    }
+
+    uint64_t now = timer_ticks();
+
+    if(next <= now) {
+        return 0;
+    }
+
+    return next - now > INT_MAX ? INT_MAX : (int)(next - now);
+}
+
+// block sizes are powers of two from SLAB_MIN_SIZE upwards, and small blocks
+// are carved out of shared chunks instead of being allocated one by one
+#define SLAB_MIN_SIZE 256
+#define SLAB_CLASS_COUNT 40
+#define SLAB_CHUNK_SIZE (256 * 1024)
+
+struct slab_block {
+    struct slab_block *next;
+};
+
+THREAD_LOCAL struct slab_block *slab_free_list[SLAB_CLASS_COUNT];
+THREAD_LOCAL char *slab_chunk;
+THREAD_LOCAL size_t slab_chunk_left;
+
+// returns NULL when out of memory, otherwise stores the block size in capacity
+void *slab_alloc(size_t size, size_t *capacity) {
+    int class = 0;
+
+    while(((size_t)SLAB_MIN_SIZE << class) < size) {
+        class += 1;
+    }
+
+    size_t block_size = (size_t)SLAB_MIN_SIZE << class;
+    void *block;
+
+    if(slab_free_list[class] != NULL) {
+        block = slab_free_list[class];
+        slab_free_list[class] = slab_free_list[class]->next;
+    } else if(block_size <= SLAB_CHUNK_SIZE / 4) {
+        if(slab_chunk_left < block_size) {
+            slab_chunk = malloc(SLAB_CHUNK_SIZE);
+
+            if(slab_chunk == NULL) {
+                slab_chunk_left = 0;
+                return NULL;
+            }
+
+            slab_chunk_left = SLAB_CHUNK_SIZE;
+        }
+
+        block = slab_chunk;
+        slab_chunk += block_size;
+        slab_chunk_left -= block_size;
+    } else {
+        block = malloc(block_size);
+
+        if(block == NULL) {
+            return NULL;
+        }
+    }
+
+    *capacity = block_size;
+    return block;
+}
+
+// blocks are kept for reuse rather than given back to the system
+void slab_free(void *block, size_t capacity) {
+    int class = 0;
+
+    while(((size_t)SLAB_MIN_SIZE << class) < capacity) {
+        class += 1;
+    }
+
+    ((struct slab_block *)block)->next = slab_free_list[class];
+    slab_free_list[class] = block;
+}
+
+int resize_buffer(struct buffer *buffer, size_t size) {
+    size_t capacity;
+    char *data = slab_alloc(size > STREAM_BUFFER_MIN_SIZE ? size : STREAM_BUFFER_MIN_SIZE, &capacity);
+
+    if(data == NULL) {
+        return -1;
+    }
+
+    if(buffer->buffer != NULL) {
+        memcpy(data, buffer->buffer, buffer->position);
+        slab_free(buffer->buffer, buffer->capacity);
+    }
+
+    buffer->buffer = data;
+    buffer->capacity = capacity;
+
+    return 0;
+}
+
+void pause_buffer(struct buffer *buffer) {
+    event_remove_source(&buffer->source);
+
+    buffer->paused = 1;
+    buffer->next_paused = buffer->destination->paused;
+    buffer->destination->paused = buffer;
+}
+
+// lets held back streams read again, unless something still holds them
+void resume_output(struct output *output) {
+    if(output->owner != NULL || output->congested) {
+        return;
+    }
+
+    while(output->paused != NULL) {
+        struct buffer *buffer = output->paused;
+
+        output->paused = buffer->next_paused;
+        buffer->paused = 0;
+        event_add(&buffer->source);
+    }
+}
+
+void release_output(struct output *output) {
+    output->owner = NULL;
+    resume_output(output);
+}
+
+void flush_buffer(struct buffer *buffer, const struct line_prefix *prefix);
+
+void close_buffer(struct buffer *buffer) {
+    if(buffer->source.fd == -1) {
+        return;
+    }
+
+    if(buffer->buffer != NULL) {
+        flush_buffer(buffer, &buffer->prefix);
+        slab_free(buffer->buffer, buffer->capacity);
+        buffer->buffer = NULL;
+        buffer->capacity = 0;
+    }
+
+    if(buffer->paused) {
+        struct buffer **link = &buffer->destination->paused;
+
+        while(*link != buffer) {
+            link = &(*link)->next_paused;
+        }
+
+        *link = buffer->next_paused;
+        buffer->paused = 0;
+    }
+
+    event_remove_source(&buffer->source);
+
+    close(buffer->source.fd);
+    buffer->source.fd = -1;
+}
+
+#ifdef SUPERVISOR_BENCHMARK
+const char *bench_self;
+char bench_arguments[5][24];
+char *bench_command[8];
+#endif
+
+char **command_for(const struct child_configuration *configuration) {
+#ifdef SUPERVISOR_BENCHMARK
+    // synthetic children are this same binary running bench_generate()
+    snprintf(&bench_arguments[0][0], 24, "%li", configuration->benchmark.lines_per_second);
+    snprintf(&bench_arguments[1][0], 24, "%li", configuration->benchmark.line_length);
+    snprintf(&bench_arguments[2][0], 24, "%li", configuration->benchmark.burst);
+    snprintf(&bench_arguments[3][0], 24, "%li", (long)BENCH_DURATION);
+    snprintf(&bench_arguments[4][0], 24, "%i", configuration->benchmark.content);
+
+    bench_command[0] = (char *)bench_self;
+    bench_command[1] = "--generate";
+    bench_command[2] = &bench_arguments[0][0];
+    bench_command[3] = &bench_arguments[1][0];
+    bench_command[4] = &bench_arguments[2][0];
+    bench_command[5] = &bench_arguments[3][0];
+    bench_command[6] = &bench_arguments[4][0];
+    bench_command[7] = NULL;
+
+    return &bench_command[0];
+#else
+    return (char **)&configuration->command[0];
+#endif
+}
+
+#ifdef __OpenBSD__
+int log_rings_configured() {
+    for(int i = 0; i < CHILDREN_COUNT; i += 1) {
+        if(child_configuration[i].log_ring) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int probes_configured(int kind) {
+    for(int i = 0; i < CHILDREN_COUNT; i += 1) {
+        if(child_configuration[i].probe.kind == kind) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// exec is kept for as long as children may still be started
+void pledge_supervisor(int keep_exec) {
+    char promises[96];
+    const char *files = "";
+    int file_probes = probes_configured(PROBE_FILE);
+
+    // log files are created again on rotation, log rings are shared memory
+    // objects that live in /tmp, and file probes look for files
+    if(log_rings_configured() || (log_file_count > 0 && file_probes)) {
+        files = " rpath wpath cpath";
+    } else if(log_file_count > 0) {
+        files = " wpath cpath";
+    } else if(file_probes) {
+        files = " rpath";
+    }
+
+    // log files are handed to the sync helper to be synced
+    snprintf(&promises[0], sizeof(promises), "stdio proc%s%s%s%s%s", keep_exec ? " exec" : "",
+        METRICS_SOCKET || probes_configured(PROBE_UNIX) ? " unix" : "", files,
+        log_file_count > 0 && LOG_FILE_SYNC_INTERVAL > 0 ? " sendfd" : "",
+        probes_configured(PROBE_TCP) || probes_configured(PROBE_HTTP) ? " inet" : "");
+
+    if(pledge(&promises[0], NULL) == -1) {
+        err(1, "pledge()");
+    }
+}
+
+// rotation renames files within the directory and creates new ones there
+void unveil_log_directory(const char *path) {
+    char directory[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+
+    if(slash == NULL) {
+        snprintf(&directory[0], sizeof(directory), ".");
+    } else {
+        snprintf(&directory[0], sizeof(directory), "%.*s", slash == path ? 1 : (int)(slash - path), path);
+    }
+
+    if(unveil(&directory[0], "rwc") == -1) {
+        err(1, "unveil(%s)", &directory[0]);
+    }
+}
+#endif
+
+int resources_configured(const struct resource_configuration *resources) {
+    return resources->address_space != 0 || resources->open_files != 0 || resources->core != 0 ||
+        resources->nice != 0 || resources->io_class != 0 || resources->cgroup != NULL;
+}
+
+// between fork() and exec, where the supervisor's exit handlers must not run
+__attribute__((noreturn, format(printf, 1, 2)))
+void child_failed(const char *format, ...) {
+    va_list arguments;
+
+    va_start(arguments, format);
+    vwarn(format, arguments);
+    va_end(arguments);
+    _exit(127);
+}
+
+rlim_t limit_value(long long value) {
+    return value == LIMIT_UNLIMITED ? RLIM_INFINITY : value == LIMIT_ZERO ? 0 : (rlim_t)value;
+}
+
+// rules out at startup what setrlimit() would refuse in every child, rather
+// than have it fail and be restarted over and over
+void check_limit(const struct child_configuration *config, int resource, long long value, const char *name) {
+    struct rlimit limit;
+
+    if(value == 0 || value == LIMIT_ZERO) {
+        return;
+    }
+
+    if(value < 0 && value != LIMIT_UNLIMITED) {
+        errx(1, "%s needs a limit on %s above 0, LIMIT_ZERO or LIMIT_UNLIMITED", config->name, name);
+    }
+
+    if(getrlimit(resource, &limit) == -1) {
+        err(1, "getrlimit() for %s", name);
+    }
+
+    rlim_t wanted = limit_value(value);
+
+    // only privileged processes can raise a hard limit
+    if(wanted > limit.rlim_max && geteuid() != 0) {
+        errx(1, "%s asks for a limit on %s above the hard limit of %llu", config->name, name, (unsigned long long int)limit.rlim_max);
+    }
+
+#ifdef __linux__
+    // which not even root can go beyond
+    if(resource == RLIMIT_NOFILE) {
+        char text[32];
+        int fd = open("/proc/sys/fs/nr_open", O_RDONLY | O_CLOEXEC);
+        ssize_t length = fd == -1 ? -1 : read(fd, &text[0], sizeof(text) - 1);
+
+        if(fd != -1) {
+            close(fd);
+        }
+
+        if(length > 0) {
+            text[length] = '\0';
+
+            unsigned long long int most = strtoull(&text[0], NULL, 10);
+
+            if(wanted > most) {
+                errx(1, "%s asks for a limit on %s above fs.nr_open, %llu", config->name, name, most);
+            }
+        }
+    }
+#endif
+}
+
+void set_limit(int resource, long long value, const char *name) {
+    struct rlimit limit;
+
+    if(value == 0) {
+        return;
+    }
+
+    limit.rlim_cur = limit_value(value);
+    limit.rlim_max = limit.rlim_cur;
+
+    if(setrlimit(resource, &limit) == -1) {
+        child_failed("setrlimit() for %s", name);
+    }
+}
+
+void apply_resources(const struct child_state *child) {
+    const struct resource_configuration *resources = &child->config->resources;
+
+#ifdef __linux__
+    // first, so that everything after is charged to the group
+    if(child->cgroup_fd != -1 && write(child->cgroup_fd, "0", 1) == -1) {
+        child_failed("could not join cgroup %s", resources->cgroup);
+    }
+#endif
+
+#ifdef RLIMIT_AS
+    set_limit(RLIMIT_AS, resources->address_space, "address space");
+#else
+    // OpenBSD has no RLIMIT_AS, and RLIMIT_DATA comes closest
+    set_limit(RLIMIT_DATA, resources->address_space, "address space");
+#endif
+    set_limit(RLIMIT_NOFILE, resources->open_files, "open files");
+    set_limit(RLIMIT_CORE, resources->core, "core dumps");
+
+    if(resources->nice != 0 && setpriority(PRIO_PROCESS, 0, resources->nice) == -1) {
+        child_failed("setpriority()");
+    }
+
+#ifdef __linux__
+    // IOPRIO_WHO_PROCESS, with the class above the level as ioprio_set(2) has it
+    if(resources->io_class != 0 && syscall(SYS_ioprio_set, 1, 0, resources->io_class << 13 | resources->io_level) == -1) {
+        child_failed("ioprio_set()");
+    }
+#endif
+}
+
+__attribute__((noreturn))
+void execute(const struct child_state *child, int p_in, int p_out, int p_err, int ring_fd, int doorbell_fd) {
+    int listen_count = child->listen_count;
+
+    // a group of its own, so that whatever it starts is signalled with it;
+    // the supervisor does the same, whichever of the two gets there first
+    setpgid(0, 0);
+
+    // before the pledge, which leaves no way to set them
+    apply_resources(child);
+
+#ifdef __OpenBSD__
+    if(pledge("stdio exec", NULL) == -1) {
+        child_failed("pledge()");
+    }
+#endif
+
+    if(dup2(p_in, STDIN_FILENO) == -1) {
+        child_failed("dup2() for stdin");
+    }
+
+    if(dup2(p_out, STDOUT_FILENO) == -1) {
+        child_failed("dup2() for stdout");
+    }
+
+    if(dup2(p_err, STDERR_FILENO) == -1) {
+        child_failed("dup2() for stderr");
+    }
+
+    // every descriptor handed over sits above where they go, so none can be
+    // overwritten before it has been put in place
+    for(int i = 0; i < listen_count; i += 1) {
+        if(dup2(child->listen_fds[i], LISTEN_FDS_START + i) == -1) {
+            child_failed("dup2() for listen socket");
+        }
+    }
+
+    char listen_fds_variable[32];
+    char listen_pid_variable[32];
+
+    if(listen_count > 0) {
+        snprintf(&listen_fds_variable[0], sizeof(listen_fds_variable), "LISTEN_FDS=%i", listen_count);
+        snprintf(&listen_pid_variable[0], sizeof(listen_pid_variable), "LISTEN_PID=%li", (long)getpid());
+        putenv(&listen_fds_variable[0]);
+        putenv(&listen_pid_variable[0]);
+        // any names were meant for the supervisor's own sockets
+        unsetenv("LISTEN_FDNAMES");
+    }
+
+    char log_ring_variable[48];
+
+    if(ring_fd != -1) {
+        int slot = LISTEN_FDS_START + listen_count;
+
+        if(dup2(ring_fd, slot) == -1 || dup2(doorbell_fd, slot + 1) == -1) {
+            child_failed("dup2() for log ring");
+        }
+
+        snprintf(&log_ring_variable[0], sizeof(log_ring_variable), "SUPERVISOR_LOG_RING=%i,%i", slot, slot + 1);
+        putenv(&log_ring_variable[0]);
+    }
+
+#ifdef __linux__
+    if(child->pinned && sched_setaffinity(0, sizeof(child->cpus), &child->cpus) == -1) {
+        child_failed("sched_setaffinity()");
+    }
+#endif
+
+    char **command = command_for(child->config);
+
+    execv(command[0], command);
+
+    child_failed("execve()");
+}
+
+extern char **environ;
+
+#if USE_POSIX_SPAWN
+pid_t spawn_without_fork(const struct child_configuration *configuration, int p_in, int p_out, int p_err, int ring_fd, int doorbell_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attributes;
+    pid_t pid;
+    char **environment = environ;
+    char log_ring_variable[48];
+    int error = posix_spawnattr_init(&attributes);
+
+    if(error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    // a process group of its own, as in execute()
+    error = posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+
+    if(error == 0) {
+        error = posix_spawnattr_setpgroup(&attributes, 0);
+    }
+
+    if(error == 0) {
+        error = posix_spawn_file_actions_init(&actions);
+    }
+
+    if(error != 0) {
+        posix_spawnattr_destroy(&attributes);
+        errno = error;
+        return -1;
+    }
+
+    if(error == 0) {
+        error = posix_spawn_file_actions_adddup2(&actions, p_in, STDIN_FILENO);
+    }
+
+    if(error == 0) {
+        error = posix_spawn_file_actions_adddup2(&actions, p_out, STDOUT_FILENO);
+    }
+
+    if(error == 0) {
+        error = posix_spawn_file_actions_adddup2(&actions, p_err, STDERR_FILENO);
+    }
+
+    // the pipe ends are not close-on-exec, so drop the originals once duplicated
+    int originals[3] = { p_in, p_out, p_err };
+
+    for(int i = 0; i < 3 && error == 0; i += 1) {
+        if(originals[i] > STDERR_FILENO) {
+            error = posix_spawn_file_actions_addclose(&actions, originals[i]);
+        }
+    }
+
+    // the ring descriptors are kept clear of the slots they go to, so these
+    // can come after the closes
+    if(error == 0 && ring_fd != -1) {
+        error = posix_spawn_file_actions_adddup2(&actions, ring_fd, LISTEN_FDS_START);
+
+        if(error == 0) {
+            error = posix_spawn_file_actions_adddup2(&actions, doorbell_fd, LISTEN_FDS_START + 1);
+        }
+
+        snprintf(&log_ring_variable[0], sizeof(log_ring_variable), "SUPERVISOR_LOG_RING=%i,%i", LISTEN_FDS_START, LISTEN_FDS_START + 1);
+
+        size_t count = 0;
+
+        while(environ[count] != NULL) {
+            count += 1;
+        }
+
+        environment = malloc((count + 2) * sizeof(char *));
+
+        if(error == 0 && environment == NULL) {
+            error = ENOMEM;
+        }
+
+        if(environment != NULL) {
+            memcpy(environment, environ, count * sizeof(char *));
+            environment[count] = &log_ring_variable[0];
+            environment[count + 1] = NULL;
+        }
+    }
+
+    if(error == 0) {
+        char **command = command_for(configuration);
+
+        error = posix_spawn(&pid, command[0], &actions, &attributes, command, environment);
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+
+    if(environment != environ) {
+        free(environment);
+    }
+
+    if(error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    return pid;
+}
+#endif
+
+pid_t spawn(const struct child_state *child, int p_in, int p_out, int p_err, int ring_fd, int doorbell_fd) {
+#if USE_POSIX_SPAWN
+    // LISTEN_PID has to name the child itself, which only a forked child
+    // knows before exec, and CPUs and resources have to be set before its
+    // threads start
+    if(child->listen_count == 0 && !child->pinned && !resources_configured(&child->config->resources)) {
+        return spawn_without_fork(child->config, p_in, p_out, p_err, ring_fd, doorbell_fd);
+    }
+#endif
+
+    pid_t pid = fork();
+
+    if(pid == 0) {
+        execute(child, p_in, p_out, p_err, ring_fd, doorbell_fd);
+    }
+
+    // so the group exists before the first signal to it; this fails once the
+    // child has execed, by which time it has made the group itself
+    if(pid > 0) {
+        setpgid(pid, pid);
+    }
+
+    return pid;
+}
+
+int find_child(const char *name) {
+    for(int i = 0; i < CHILDREN_COUNT; i += 1) {
+        if(strcmp(child_configuration[i].name, name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// walks configured children rather than instances, which share dependencies;
+// unknown names have been ruled out already
+int has_dependency_cycle(int i, int *marks) {
+    const struct child_configuration *config = &child_configuration[i];
+
+    // 1 while on the current path, 2 once fully explored
+    if(marks[i] == 1) {
+        return 1;
+    } else if(marks[i] == 2) {
+        return 0;
+    }
+
+    marks[i] = 1;
+
+    for(int j = 0; config->depends_on[j] != NULL; j += 1) {
+        if(has_dependency_cycle(find_child(config->depends_on[j]), marks)) {
+            return 1;
+        }
+    }
+
+    for(int j = 0; j < CHILDREN_COUNT && config->depends_on[0] == NULL && !config->is_startup_check; j += 1) {
+        if(child_configuration[j].is_startup_check && has_dependency_cycle(j, marks)) {
+            return 1;
+        }
+    }
+
+    marks[i] = 2;
+    return 0;
+}
+
+// a startup check that is only a probe, with no process to start
+int probe_only(const struct child_configuration *config) {
+    return config->is_startup_check && config->probe.kind != PROBE_NONE && config->command[0] == NULL;
+}
+
+// fills in the address of a TCP or HTTP probe or a listen socket; names are
+// not looked up, as that would hold up the event loop
+int parse_address(const char *target, struct sockaddr_storage *address, socklen_t *length) {
+    const char *colon = strrchr(target, ':');
+    char host[INET6_ADDRSTRLEN];
+
+    if(colon == NULL) {
+        return -1;
+    }
+
+    const char *start = target;
+    size_t host_length = colon - target;
+
+    if(host_length >= 2 && target[0] == '[' && colon[-1] == ']') {
+        start += 1;
+        host_length -= 2;
+    }
+
+    if(host_length >= sizeof(host)) {
+        return -1;
+    }
+
+    memcpy(&host[0], start, host_length);
+    host[host_length] = '\0';
+
+    char *end;
+    long port = strtol(colon + 1, &end, 10);
+
+    if(colon[1] == '\0' || *end != '\0' || port < 1 || port > 65535) {
+        return -1;
+    }
+
+    struct sockaddr_in *v4 = (struct sockaddr_in *)address;
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)address;
+
+    bzero(address, sizeof(*address));
+
+    if(inet_pton(AF_INET, &host[0], &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(port);
+        *length = sizeof(*v4);
+        return 0;
+    }
+
+    if(inet_pton(AF_INET6, &host[0], &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(port);
+        *length = sizeof(*v6);
+        return 0;
+    }
+
+    return -1;
+}
+
+void setup_probe(struct child_state *child) {
+    const struct child_configuration *config = child->config;
+    const struct probe_configuration *probe = &config->probe;
+
+    if(probe->kind < PROBE_TCP || probe->kind > PROBE_FILE || probe->target == NULL) {
+        errx(1, "the probe of %s needs a kind and a target", config->name);
+    }
+
+    if(config->is_startup_check && config->command[0] != NULL) {
+        errx(1, "startup check %s cannot have both a command and a probe", config->name);
+    }
+
+    if(probe->kind == PROBE_TCP || probe->kind == PROBE_HTTP) {
+        if(parse_address(probe->target, &child->probe.address, &child->probe.address_length) == -1) {
+            errx(1, "the probe of %s needs a numeric address and a port, not %s", config->name, probe->target);
+        }
+    } else if(probe->kind == PROBE_UNIX) {
+        struct sockaddr_un *address = (struct sockaddr_un *)&child->probe.address;
+
+        if(strlen(probe->target) >= sizeof(address->sun_path)) {
+            errx(1, "the probe socket path %s is too long", probe->target);
+        }
+
+        address->sun_family = AF_UNIX;
+        strcpy(&address->sun_path[0], probe->target);
+        child->probe.address_length = sizeof(*address);
+    }
+}
+
+#ifdef __linux__
+// fills a set from a list such as "0-3,8", of CPUs or of NUMA nodes
+int parse_cpu_list(const char *list, cpu_set_t *set) {
+    const char *next = list;
+
+    CPU_ZERO(set);
+
+    while(1) {
+        char *end;
+        long first = strtol(next, &end, 10);
+        long last = first;
+
+        if(end == next) {
+            return -1;
+        }
+
+        if(*end == '-') {
+            next = end + 1;
+            last = strtol(next, &end, 10);
+
+            if(end == next) {
+                return -1;
+            }
+        }
+
+        if(first < 0 || last < first || last >= CPU_SETSIZE) {
+            return -1;
+        }
+
+        for(long cpu = first; cpu <= last; cpu += 1) {
+            CPU_SET(cpu, set);
+        }
+
+        // sysfs ends its lists with a line feed
+        if(*end == '\0' || *end == '\n') {
+            return 0;
+        }
+
+        if(*end != ',') {
+            return -1;
+        }
+
+        next = end + 1;
+    }
+}
+
+int read_node_cpus(int node, cpu_set_t *set) {
+    char path[64];
+    char text[4096];
+
+    snprintf(&path[0], sizeof(path), "/sys/devices/system/node/node%i/cpulist", node);
+
+    int fd = open(&path[0], O_RDONLY | O_CLOEXEC);
+
+    if(fd == -1) {
+        return -1;
+    }
+
+    ssize_t length = read(fd, &text[0], sizeof(text) - 1);
+
+    close(fd);
+
+    if(length < 0) {
+        return -1;
+    }
+
+    text[length] = '\0';
+
+    return parse_cpu_list(&text[0], set);
+}
+#endif
+
+// works out the CPUs an instance is kept to, if any
+void setup_pinning(struct child_state *child) {
+#ifdef __linux__
+    const struct child_configuration *config = child->config;
+    cpu_set_t set;
+
+    if(config->cpus == NULL && config->numa_nodes == NULL) {
+        return;
+    }
+
+    if(config->cpus != NULL && parse_cpu_list(config->cpus, &set) == -1) {
+        errx(1, "%s has a CPU list that could not be read: %s", config->name, config->cpus);
+    }
+
+    if(config->numa_nodes != NULL) {
+        cpu_set_t nodes;
+        cpu_set_t node_cpus;
+
+        if(parse_cpu_list(config->numa_nodes, &nodes) == -1) {
+            errx(1, "%s has a NUMA node list that could not be read: %s", config->name, config->numa_nodes);
+        }
+
+        CPU_ZERO(&node_cpus);
+
+        for(int node = 0; node < CPU_SETSIZE; node += 1) {
+            cpu_set_t cpus;
+
+            if(!CPU_ISSET(node, &nodes)) {
+                continue;
+            }
+
+            if(read_node_cpus(node, &cpus) == -1) {
+                err(1, "could not read the CPUs of NUMA node %i", node);
+            }
+
+            CPU_OR(&node_cpus, &node_cpus, &cpus);
+        }
+
+        if(config->cpus == NULL) {
+            set = node_cpus;
+        } else {
+            CPU_AND(&set, &set, &node_cpus);
+        }
+    }
+
+    cpu_set_t allowed;
+
+    // CPUs the supervisor may not use are left out, as a container can
+    // have fewer than the machine
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        err(1, "sched_getaffinity()");
+    }
+
+    CPU_AND(&set, &set, &allowed);
+
+    if(CPU_COUNT(&set) == 0) {
+        errx(1, "%s has no CPUs left to run on", config->name);
+    }
+
+    CPU_ZERO(&child->cpus);
+
+    if(config->pin_instances) {
+        int wanted = child->instance % CPU_COUNT(&set);
+
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu += 1) {
+            if(CPU_ISSET(cpu, &set) && wanted-- == 0) {
+                CPU_SET(cpu, &child->cpus);
+                break;
+            }
+        }
+    } else {
+        child->cpus = set;
+    }
+
+    child->pinned = 1;
+#else
+    (void)child;
+#endif
+}
+
+// gives every instance of every child its slot, in order
+void setup_instances() {
+    int slot = 0;
+
+    for(int i = 0; i < CHILDREN_COUNT; i += 1) {
+        const struct child_configuration *config = &child_configuration[i];
+        int instances = config->instances > 0 ? config->instances : 1;
+
+        if(slot + instances > INSTANCES_COUNT) {
+            errx(1, "INSTANCES_COUNT is %i, which leaves no room for every instance of %s", INSTANCES_COUNT, config->name);
+        }
+
+        for(int k = 0; k < instances; k += 1) {
+            struct child_state *child = &children[slot];
+
+            child->config = config;
+            child->instance = k;
+            child->name = config->name;
+            child->cgroup_fd = -1;
+
+            if(instances > 1) {
+                size_t size = strlen(config->name) + 16;
+                char *name = malloc(size);
+
+                if(name == NULL) {
+                    err(1, "malloc");
+                }
+
+                snprintf(name, size, "%s.%i", config->name, k + 1);
+                child->name = name;
+            }
+
+            setup_pinning(child);
+            slot += 1;
+        }
+    }
+
+    if(slot != INSTANCES_COUNT) {
+        errx(1, "INSTANCES_COUNT is %i, but the children add up to %i instances", INSTANCES_COUNT, slot);
+    }
+}
+
+void setup_configuration() {
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        struct child_state *child = &children[i];
+        const struct child_configuration *config = child->config;
+
+        // nothing is read until the child has been started
+        child->out_buffer.source.fd = -1;
+        child->err_buffer.source.fd = -1;
+        child->ring_buffer.source.fd = -1;
+        child->probe.source.fd = -1;
+
+        if(find_child(config->name) != config - &child_configuration[0]) {
+            errx(1, "more than one child is named %s", config->name);
+        }
+
+        if(config->is_startup_check && config->restart == RESTART_ALWAYS) {
+            errx(1, "startup check %s can only be restarted on failure", config->name);
+        }
+
+        if(config->log_ring && config->passthrough) {
+            errx(1, "%s cannot pass its output through and have a log ring", config->name);
+        }
+
+        if(config->probe.kind != PROBE_NONE) {
+            setup_probe(child);
+        }
+
+        const struct resource_configuration *resources = &config->resources;
+
+#ifdef RLIMIT_AS
+        check_limit(config, RLIMIT_AS, resources->address_space, "address space");
+#else
+        check_limit(config, RLIMIT_DATA, resources->address_space, "address space");
+#endif
+        check_limit(config, RLIMIT_NOFILE, resources->open_files, "open files");
+        check_limit(config, RLIMIT_CORE, resources->core, "core dumps");
+
+        if(resources->nice < -20 || resources->nice > 19) {
+            errx(1, "%s needs a niceness from -20 to 19", config->name);
+        }
+
+        if(resources->io_class < 0 || resources->io_class > IO_CLASS_IDLE || resources->io_level < 0 || resources->io_level > 7) {
+            errx(1, "%s needs an IO class and a level from 0 to 7", config->name);
+        }
+
+        if((resources->cpu_max != NULL || resources->memory_max != NULL) && resources->cgroup == NULL) {
+            errx(1, "%s needs a cgroup for its cpu.max or memory.max", config->name);
+        }
+
+#ifndef SUPERVISOR_BENCHMARK
+        if(config->command[0] == NULL && !probe_only(config)) {
+            errx(1, "%s has no command, which only a startup check with a probe can do without", config->name);
+        }
+#endif
+
+        if(config->restart != RESTART_NEVER) {
+            restarts_configured = 1;
+        }
+
+        if(config->is_startup_check) {
+            checks_pending += 1;
+        } else {
+            normal_pending += 1;
+        }
+
+        if(config->depends_on[0] == NULL && !config->is_startup_check) {
+            child->waits_for_checks = 1;
+        }
+
+        for(int j = 0; config->depends_on[j] != NULL; j += 1) {
+            int dependency = find_child(config->depends_on[j]);
+
+            if(dependency == -1) {
+                errx(1, "%s depends on unknown child %s", config->name, config->depends_on[j]);
+            }
+
+            child->dependencies[child->dependency_count] = dependency;
+            child->dependency_count += 1;
+        }
+    }
+
+    int marks[CHILDREN_COUNT];
+
+    bzero(&marks[0], sizeof(marks));
+
+    for(int i = 0; i < CHILDREN_COUNT; i += 1) {
+        if(has_dependency_cycle(i, &marks[0])) {
+            errx(1, "dependency cycle reachable from %s", child_configuration[i].name);
+        }
+    }
+}
+
+// open addressed pid to child table, at most half full so probes stay short
+#define PID_TABLE_SIZE (PID_TABLE_SIZE_FOR(INSTANCES_COUNT * 2))
+#define PID_TABLE_SIZE_FOR(n) \
+    ((n) <= 16 ? 16 : (n) <= 256 ? 256 : (n) <= 4096 ? 4096 : (n) <= 65536 ? 65536 : 1048576)
+
+struct child_state *pid_table[PID_TABLE_SIZE];
+
+size_t pid_slot(pid_t pid) {
+    // fibonacci hashing, as pids tend to arrive in runs
+    return ((uint32_t)pid * 2654435769u) & (PID_TABLE_SIZE - 1);
+}
+
+void pid_table_insert(struct child_state *child) {
+    size_t slot = pid_slot(child->pid);
+
+    while(pid_table[slot] != NULL) {
+        slot = (slot + 1) & (PID_TABLE_SIZE - 1);
+    }
+
+    pid_table[slot] = child;
+}
+
+struct child_state *pid_table_find(pid_t pid) {
+    for(size_t slot = pid_slot(pid); pid_table[slot] != NULL; slot = (slot + 1) & (PID_TABLE_SIZE - 1)) {
+        if(pid_table[slot]->pid == pid) {
+            return pid_table[slot];
+        }
+    }
+
+    return NULL;
+}
+
+void pid_table_remove(struct child_state *child) {
+    size_t slot = pid_slot(child->pid);
+
+    while(pid_table[slot] != child) {
+        slot = (slot + 1) & (PID_TABLE_SIZE - 1);
+    }
+
+    // shift later entries of the run back, so no tombstones are needed
+    for(size_t next = (slot + 1) & (PID_TABLE_SIZE - 1); pid_table[next] != NULL; next = (next + 1) & (PID_TABLE_SIZE - 1)) {
+        size_t home = pid_slot(pid_table[next]->pid);
+
+        if(((next - home) & (PID_TABLE_SIZE - 1)) >= ((next - slot) & (PID_TABLE_SIZE - 1))) {
+            pid_table[slot] = pid_table[next];
+            slot = next;
+        }
+    }
+
+    pid_table[slot] = NULL;
+}
+
+#if IO_WORKERS > 0
+// bytes from one worker to one destination, written only by the worker and
+// read only by the main thread; the positions run on and wrap around the data
+struct ring {
+    atomic_size_t head;
+    char head_line[64 - sizeof(atomic_size_t)];
+    atomic_size_t tail;
+    char tail_line[64 - sizeof(atomic_size_t)];
+    char data[IO_WORKER_RING_SIZE];
+};
+
+#define WORKER_ADD 0
+#define WORKER_CLOSE 1
+#define WORKER_STOP 2
+
+struct worker_command {
+    int kind;
+    struct child_state *child;
+    struct child_streams streams;
+};
+
+// enough for every child to be started and reaped a few times over before
+// the worker gets round to it
+#define WORKER_COMMAND_COUNT (PID_TABLE_SIZE_FOR(INSTANCES_COUNT * 4))
+
+struct worker {
+    pthread_t thread;
+    // written by the main thread once there is a command or room in a ring
+    int wake_r;
+    int wake_w;
+    struct event_source wake_source;
+    // written by the worker once there is something in a ring
+    int doorbell_r;
+    int doorbell_w;
+    struct event_source doorbell_source;
+    atomic_int doorbell_rung;
+    // set while the worker waits for room in a ring
+    atomic_int wants_wake;
+    atomic_int finished;
+    atomic_size_t command_head;
+    atomic_size_t command_tail;
+    struct worker_command commands[WORKER_COMMAND_COUNT];
+    // per destination, where lines are staged and the ring they are sent on
+    struct output *outputs[2 + CHILDREN_COUNT];
+    struct ring *rings[2 + CHILDREN_COUNT];
+    // set once a ring has been written to since the doorbell last rang
+    int pushed;
+#ifdef SUPERVISOR_BENCHMARK
+    uint64_t bench_lines;
+    struct histogram bench_latency;
+#endif
+};
+
+struct worker workers[IO_WORKERS];
+// per destination, the worker whose ring has passed on only part of a line
+// and so has to be drained until its end first, or -1
+int ring_owners[2 + CHILDREN_COUNT];
+
+// children are dealt out to the workers in turn
+struct worker *worker_for(const struct child_state *child) {
+    return &workers[(child - &children[0]) % IO_WORKERS];
+}
+
+void drain_workers(int everything);
+
+void send_worker_command(struct worker *worker, int kind, struct child_state *child, const struct child_streams *streams) {
+    size_t tail = atomic_load_explicit(&worker->command_tail, memory_order_relaxed);
+
+    // only a worker stuck on a full ring falls this far behind
+    while(tail - atomic_load_explicit(&worker->command_head, memory_order_acquire) == WORKER_COMMAND_COUNT) {
+        drain_workers(0);
+        sched_yield();
+    }
+
+    worker->commands[tail & (WORKER_COMMAND_COUNT - 1)] = (struct worker_command){ .kind = kind, .child = child };
+
+    if(streams != NULL) {
+        worker->commands[tail & (WORKER_COMMAND_COUNT - 1)].streams = *streams;
+    }
+
+    atomic_store_explicit(&worker->command_tail, tail + 1, memory_order_release);
+    write(worker->wake_w, "x", 1);
+}
+#endif
+
+// starts reading the pipes of a child that has just been started, with
+// destinations being those of whichever thread does the reading
+int open_streams(struct child_state *child, const struct child_streams *streams, struct output **destinations) {
+    child->err_buffer.source = (struct event_source){ .fd = streams->err_fd, .flavour = FLAVOUR_STDERR, .events = EVENT_READ, .index = -1, .object = child };
+    child->err_buffer.destination = destinations[destination_of(child, FLAVOUR_STDERR)];
+    child->err_buffer.position = 0;
+    child->err_buffer.overflow = 0;
+    child->out_buffer.source = (struct event_source){ .fd = streams->out_fd, .flavour = FLAVOUR_STDOUT, .events = EVENT_READ, .index = -1, .object = child };
+    child->out_buffer.destination = destinations[destination_of(child, FLAVOUR_STDOUT)];
+    child->out_buffer.position = 0;
+    child->out_buffer.overflow = 0;
+
+    if(event_add(&child->out_buffer.source) == -1 || event_add(&child->err_buffer.source) == -1) {
+        return -1;
+    }
+
+    if(streams->ring == NULL) {
+        return 0;
+    }
+
+    child->ring = streams->ring;
+    child->ring_head = 0;
+    child->ring_doorbell = streams->doorbell_w;
+    child->ring_buffer.source = (struct event_source){ .fd = streams->doorbell_r, .flavour = FLAVOUR_RING, .events = EVENT_READ, .index = -1, .object = child };
+    child->ring_buffer.destination = destinations[destination_of(child, FLAVOUR_RING)];
+    child->ring_buffer.position = 0;
+    child->ring_buffer.overflow = 0;
+
+    return event_add(&child->ring_buffer.source);
+}
+
+int pump_stream(struct child_state *child, struct buffer *buffer);
+int pump_ring(struct child_state *child, struct buffer *buffer);
+
+// picks up whatever the child wrote just before exiting and stops reading
+void close_streams(struct child_state *child) {
+    pump_stream(child, &child->err_buffer);
+    pump_stream(child, &child->out_buffer);
+
+    close_buffer(&child->err_buffer);
+    close_buffer(&child->out_buffer);
+
+    if(child->ring == NULL) {
+        return;
+    }
+
+    // nothing more can be written to the ring, so all of it is taken now
+    while(child->ring_buffer.source.fd != -1 && atomic_load(&child->ring->tail) != child->ring_head) {
+        if(pump_ring(child, &child->ring_buffer) == -1) {
+            break;
+        }
+    }
+
+    close_buffer(&child->ring_buffer);
+    close(child->ring_doorbell);
+    munmap(child->ring, sizeof(struct log_ring));
+    child->ring = NULL;
+}
+
+// moves a descriptor above those a child is given, so that putting the
+// others in place cannot overwrite it
+int above_child_descriptors(int fd) {
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, CHILD_DESCRIPTORS_END);
+
+    close(fd);
+
+    return moved;
+}
+
+void open_listen_socket(struct child_state *child, const char *name, const char *target) {
+    struct sockaddr_storage address;
+    socklen_t length;
+    struct sockaddr_un *local = (struct sockaddr_un *)&address;
+
+    if(strchr(target, '/') != NULL) {
+        bzero(&address, sizeof(address));
+
+        if(strlen(target) >= sizeof(local->sun_path)) {
+            errx(1, "the listen socket path %s is too long", target);
+        }
+
+        local->sun_family = AF_UNIX;
+        strcpy(&local->sun_path[0], target);
+        length = sizeof(*local);
+    } else if(parse_address(target, &address, &length) == -1) {
+        errx(1, "%s needs to listen on a socket path or a numeric address and a port, not %s", name, target);
+    }
+
+    int fd = socket(address.ss_family, SOCK_STREAM, 0);
+    int yes = 1;
+
+    if(fd == -1) {
+        err(1, "socket()");
+    }
+
+    if(address.ss_family == AF_UNIX) {
+        // as with the metrics socket, what an earlier run left behind goes
+        if(unlink(target) == -1 && errno != ENOENT) {
+            err(1, "unlink(%s)", target);
+        }
+    } else if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
+        err(1, "setsockopt(..., SO_REUSEADDR)");
+    }
+
+    if(bind(fd, (struct sockaddr *)&address, length) == -1) {
+        err(1, "bind(%s)", target);
+    }
+
+    if(listen(fd, SOMAXCONN) == -1) {
+        err(1, "listen()");
+    }
+
+    // sockets stay blocking, as children expect of what they are given
+    fd = above_child_descriptors(fd);
+
+    if(fd == -1) {
+        err(1, "fcntl(..., F_DUPFD_CLOEXEC)");
+    }
+
+    child->listen_fds[child->listen_count] = fd;
+    child->listen_count += 1;
+}
+
+// like the metrics socket, these are bound before the file system is hidden
+void open_listen_sockets() {
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        struct child_state *child = &children[i];
+        const struct child_configuration *config = child->config;
+
+        // instances all accept from the sockets of the first
+        if(i > 0 && child->instance > 0) {
+            memcpy(&child->listen_fds[0], &children[i - 1].listen_fds[0], sizeof(child->listen_fds));
+            child->listen_count = children[i - 1].listen_count;
+            continue;
+        }
+
+        for(int j = 0; config->listen[j] != NULL; j += 1) {
+            open_listen_socket(child, config->name, config->listen[j]);
+        }
+    }
+}
+
+#ifdef __linux__
+// into a buffer of PATH_MAX, refusing a path that does not fit rather than
+// cutting it short
+void cgroup_path(char *path, const char *format, ...) {
+    va_list arguments;
+
+    va_start(arguments, format);
+    int length = vsnprintf(path, PATH_MAX, format, arguments);
+    va_end(arguments);
+
+    if(length < 0 || length >= PATH_MAX) {
+        errx(1, "a cgroup path is too long");
+    }
+}
+
+void write_cgroup_file(const char *group, const char *file, const char *text) {
+    char path[PATH_MAX];
+
+    cgroup_path(&path[0], "%s/%s", group, file);
+
+    int fd = open(&path[0], O_WRONLY | O_CLOEXEC);
+
+    if(fd == -1 || write(fd, text, strlen(text)) == -1) {
+        err(1, "could not write %s to %s", text, &path[0]);
+    }
+
+    close(fd);
+}
+
+// the group the supervisor was started in, from its unified hierarchy entry
+void find_own_cgroup(char *path) {
+    char text[PATH_MAX + 64];
+    int fd = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC);
+    ssize_t length = fd == -1 ? -1 : read(fd, &text[0], sizeof(text) - 1);
+
+    close(fd);
+
+    if(length < 0) {
+        err(1, "could not read /proc/self/cgroup");
+    }
+
+    text[length] = '\0';
+
+    char *entry = strstr(&text[0], "0::/");
+
+    if(entry == NULL || (entry != &text[0] && entry[-1] != '\n')) {
+        errx(1, "cgroups need the unified hierarchy of cgroup v2");
+    }
+
+    // systems that still have cgroup v1 mount the unified hierarchy aside
+    const char *mount = access("/sys/fs/cgroup/cgroup.controllers", F_OK) == 0 ? "/sys/fs/cgroup" : "/sys/fs/cgroup/unified";
+
+    // past "0::", leaving out the slash of the root group
+    entry += 3;
+    int entry_length = strcspn(entry, "\n");
+
+    cgroup_path(path, "%s%.*s", mount, entry_length == 1 ? 0 : entry_length, entry);
+}
+
+// makes the groups of children beside a leaf the supervisor moves itself to,
+// as a group that hands controllers down cannot have processes of its own;
+// groups are left behind on exit, to be used again next time
+void setup_cgroups() {
+    char base[PATH_MAX];
+    char group[PATH_MAX];
+    int cpu = 0;
+    int memory = 0;
+    int found = 0;
+
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        const struct resource_configuration *resources = &children[i].config->resources;
+
+        found |= resources->cgroup != NULL;
+        cpu |= resources->cpu_max != NULL;
+        memory |= resources->memory_max != NULL;
+    }
+
+    if(!found) {
+        return;
+    }
+
+    find_own_cgroup(&base[0]);
+    cgroup_path(&group[0], "%s/supervisor", &base[0]);
+
+    if(mkdir(&group[0], 0755) == -1 && errno != EEXIST) {
+        err(1, "mkdir(%s)", &group[0]);
+    }
+
+    write_cgroup_file(&group[0], "cgroup.procs", "0");
+
+    if(cpu) {
+        write_cgroup_file(&base[0], "cgroup.subtree_control", "+cpu");
+    }
+
+    if(memory) {
+        write_cgroup_file(&base[0], "cgroup.subtree_control", "+memory");
+    }
+
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        struct child_state *child = &children[i];
+        const struct child_configuration *config = child->config;
+        const struct resource_configuration *resources = &config->resources;
+
+        if(resources->cgroup == NULL) {
+            continue;
+        }
+
+        if(config->instances > 1) {
+            cgroup_path(&group[0], "%s/%s.%i", &base[0], resources->cgroup, child->instance + 1);
+        } else {
+            cgroup_path(&group[0], "%s/%s", &base[0], resources->cgroup);
+        }
+
+        if(mkdir(&group[0], 0755) == -1 && errno != EEXIST) {
+            err(1, "mkdir(%s)", &group[0]);
+        }
+
+        if(resources->cpu_max != NULL) {
+            write_cgroup_file(&group[0], "cpu.max", resources->cpu_max);
+        }
+
+        if(resources->memory_max != NULL) {
+            write_cgroup_file(&group[0], "memory.max", resources->memory_max);
+        }
+
+        char procs[PATH_MAX];
+
+        cgroup_path(&procs[0], "%s/cgroup.procs", &group[0]);
+        child->cgroup_fd = open(&procs[0], O_WRONLY | O_CLOEXEC);
+
+        if(child->cgroup_fd == -1) {
+            err(1, "open(%s)", &procs[0]);
+        }
+
+        child->cgroup_fd = above_child_descriptors(child->cgroup_fd);
+    }
+}
+#endif
+
+// creates the shared memory and doorbell pipe of a log ring for one run of
+// a child; only the read end of the doorbell is non-blocking
+int open_log_ring(struct child_state *child, struct child_streams *streams, int *ring_fd, int *doorbell_child) {
+    int doorbell[2];
+    // an anonymous shared memory object wherever there is a way to make one,
+    // or else a named one that is unlinked straight away
+#ifdef __OpenBSD__
+    char path[] = "/tmp/simple-supervisor.XXXXXXXX";
+    int fd = shm_mkstemp(&path[0]);
+
+    if(fd != -1) {
+        shm_unlink(&path[0]);
+    }
+#elif defined(MFD_CLOEXEC)
+    int fd = memfd_create("simple-supervisor-log-ring", MFD_CLOEXEC);
+#elif defined(SHM_ANON)
+    int fd = shm_open(SHM_ANON, O_RDWR | O_CREAT, 0600);
+#else
+    // short, as macOS allows only 31 bytes
+    static int rings_opened;
+    char path[32];
+
+    snprintf(&path[0], sizeof(path), "/supervisor.%li.%i", (long)getpid(), rings_opened);
+    rings_opened += 1;
+
+    int fd = shm_open(&path[0], O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    if(fd != -1) {
+        shm_unlink(&path[0]);
+    }
+#endif
+
+    if(fd == -1) {
+        warn("could not create log ring for %s", child->name);
+        return -1;
+    }
+
+    fd = above_child_descriptors(fd);
+
+    if(fd == -1 || ftruncate(fd, sizeof(struct log_ring)) == -1) {
+        warn("could not size log ring for %s", child->name);
+        close(fd);
+        return -1;
+    }
+
+    struct log_ring *ring = mmap(NULL, sizeof(struct log_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if(ring == MAP_FAILED) {
+        warn("could not map log ring for %s", child->name);
+        close(fd);
+        return -1;
+    }
+
+    // nothing has been taken yet, so the first write has to ring
+    ring->size = LOG_RING_SIZE;
+    atomic_store(&ring->waiting, 1);
+
+    if(pipe(&doorbell[0]) == -1) {
+        warn("pipe()");
+        munmap(ring, sizeof(struct log_ring));
+        close(fd);
+        return -1;
+    }
+
+    doorbell[0] = above_child_descriptors(doorbell[0]);
+    doorbell[1] = above_child_descriptors(doorbell[1]);
+
+    if(doorbell[0] == -1 || doorbell[1] == -1 || fcntl(doorbell[0], F_SETFL, O_NONBLOCK) == -1) {
+        warn("could not set up doorbell for %s", child->name);
+        close(doorbell[0]);
+        close(doorbell[1]);
+        munmap(ring, sizeof(struct log_ring));
+        close(fd);
+        return -1;
+    }
+
+    // the supervisor keeps a write end of its own, as the child's goes away
+    // with it while there may still be lines in the ring
+    streams->ring = ring;
+    streams->doorbell_r = doorbell[0];
+    streams->doorbell_w = fcntl(doorbell[1], F_DUPFD_CLOEXEC, 0);
+
+    if(streams->doorbell_w == -1) {
+        warn("fcntl(..., F_DUPFD_CLOEXEC)");
+        close(doorbell[0]);
+        close(doorbell[1]);
+        munmap(ring, sizeof(struct log_ring));
+        close(fd);
+        return -1;
+    }
+
+    *ring_fd = fd;
+    *doorbell_child = doorbell[1];
+
+    return 0;
+}
+
+void start_probe(struct child_state *child);
+
+// undoes what start_child() had set up when it fails partway, so that it can
+// be tried again on restart or reload without leaking; -1 marks what is unset
+int abandon_start(const int *p_in, const int *p_out, const int *p_err, int ring_fd, int doorbell_child, const struct child_streams *streams) {
+    int fds[] = { p_in[0], p_in[1], p_out[0], p_out[1], p_err[0], p_err[1], ring_fd, doorbell_child, streams->doorbell_r, streams->doorbell_w };
+
+    for(size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i += 1) {
+        if(fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+
+    if(streams->ring != NULL) {
+        munmap(streams->ring, sizeof(struct log_ring));
+    }
+
+    return -1;
+}
+
+int start_child(struct child_state *child) {
+    const struct child_configuration *config = child->config;
+    int p_err[2] = { -1, -1 };
+    int p_in[2] = { -1, -1 };
+    int p_out[2] = { -1, -1 };
+    struct child_streams streams = { .out_fd = -1, .err_fd = -1, .ring = NULL, .doorbell_r = -1, .doorbell_w = -1 };
+    int ring_fd = -1;
+    int doorbell_child = -1;
+
+    if(pipe(&p_err[0]) == -1 || pipe(&p_in[0]) == -1 || pipe(&p_out[0]) == -1) {
+        warn("pipe()");
+        return abandon_start(p_in, p_out, p_err, ring_fd, doorbell_child, &streams);
+    }
+
+    close(p_in[1]);
+    p_in[1] = -1;
+
+    if(fcntl(p_err[0], F_SETFD, FD_CLOEXEC) == -1) {
+        warn("fcntl(..., F_SETFD, FD_CLOEXEC)");
+        return abandon_start(p_in, p_out, p_err, ring_fd, doorbell_child, &streams);
+    }
+
+    if(fcntl(p_out[0], F_SETFD, FD_CLOEXEC) == -1) {
+        warn("fcntl(..., F_SETFD, FD_CLOEXEC)");
+        return abandon_start(p_in, p_out, p_err, ring_fd, doorbell_child, &streams);
+    }
+
+    if(fcntl(p_err[0], F_SETFL, O_NONBLOCK) == -1) {
+        warn("fcntl(..., F_SETFL, O_NONBLOCK)");
+        return abandon_start(p_in, p_out, p_err, ring_fd, doorbell_child, &streams);
+    }
+
+    if(fcntl(p_out[0], F_SETFL, O_NONBLOCK) == -1) {
+        warn("fcntl(..., F_SETFL, O_NONBLOCK)");
+        return abandon_start(p_in, p_out, p_err, ring_fd, doorbell_child, &streams);
+    }
+
+    // open_log_ring() cleans up after itself, leaving only the pipes
+    if(config->log_ring && open_log_ring(child, &streams, &ring_fd, &doorbell_child) == -1) {
+        return abandon_start(p_in, p_out, p_err, ring_fd, doorbell_child, &streams);
+    }
+
+    pid_t pid = spawn(child, p_in[0], p_out[1], p_err[1], ring_fd, doorbell_child);
+
+    if(pid == -1) {
+        warn("could not spawn %s", child->name);
+        return abandon_start(p_in, p_out, p_err, ring_fd, doorbell_child, &streams);
+    }
+
+    streams.out_fd = p_out[0];
+    streams.err_fd = p_err[0];
+
+    close(p_in[0]);
+    close(p_out[1]);
+    close(p_err[1]);
+
+    // the mapping stays, while the descriptors are the child's now
+    if(ring_fd != -1) {
+        close(ring_fd);
+        close(doorbell_child);
+    }
+
+    child->pid = pid;
+    child->running = 1;
+    child->started_at = monotonic_ns();
+    pid_table_insert(child);
+    start_probe(child);
+
+#if IO_WORKERS > 0
+    send_worker_command(worker_for(child), WORKER_ADD, child, &streams);
+    return 0;
+#else
+    return open_streams(child, &streams, &destinations[0]);
+#endif
+}
+
+void teardown();
+
+#ifdef SUPERVISOR_BENCHMARK
+uint64_t bench_spawned_at;
+#endif
+
+// a child with more than one instance only once all of them are
+int dependency_satisfied(int index) {
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        if(children[i].config == &child_configuration[index] && !children[i].satisfied) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// starts every child whose dependencies are satisfied, until nothing changes
+void schedule_children() {
+    int progress = 1;
+
+    while(progress && !teardown_in_progress) {
+        progress = 0;
+
+        for(int i = 0; i < INSTANCES_COUNT && !teardown_in_progress; i += 1) {
+            struct child_state *child = &children[i];
+            int ready = !child->started && !(child->waits_for_checks && checks_pending > 0);
+
+            for(int j = 0; j < child->dependency_count && ready; j += 1) {
+                ready = dependency_satisfied(child->dependencies[j]);
+            }
+
+            if(!ready) {
+                continue;
+            }
+
+            child->started = 1;
+            progress = 1;
+
+            if(probe_only(child->config)) {
+                start_probe(child);
+                continue;
+            }
+
+            if(start_child(child) == -1) {
+                system_message("Not all children could be spawned.");
+                teardown();
+                break;
+            }
+
+            if(!child->config->is_startup_check) {
+                // dependents of a child with a probe wait for it to pass
+                child->satisfied = child->config->probe.kind == PROBE_NONE;
+                normal_pending -= 1;
+
+                if(normal_pending == 0) {
+                    system_message("All processes have been spawned.");
+
+#ifdef SUPERVISOR_BENCHMARK
+                    bench_spawned_at = monotonic_ns();
+#endif
+
+#ifdef __OpenBSD__
+                    pledge_supervisor(restarts_configured);
+#endif
+                }
+            }
+        }
+    }
+}
+
+void setup_signal_handler() {
+    {
+        int fds[2];
+
+        if(pipe(&fds[0]) == -1) {
+            err(1, "pipe()");
+        }
+
+        signal_r = fds[0];
+        signal_w = fds[1];
+
+        signal_source.fd = signal_r;
+
+        if(event_add(&signal_source) == -1) {
+            exit(1);
+        }
+
+        if(fcntl(signal_w, F_SETFL, O_NONBLOCK) == -1) {
+            err(1, "fcntl(%i, F_SETFL, O_NONBLOCK)", signal_w);
+        }
+    }
+
+    struct sigaction sig;
+
+    bzero(&sig, sizeof(struct sigaction));
+
+    sig.sa_handler = signal_handler;
+
+    if(sigemptyset(&sig.sa_mask) == -1) {
+        errx(1, "could not clear signal mask");
+    }
+
+    if(sigaction(SIGTERM, &sig, NULL) == -1) {
+        err(1, "could not set SIGTERM handler");
+    }
+
+    if(sigaction(SIGINT, &sig, NULL) == -1) {
+        err(1, "could not set SIGINT handler");
+    }
+
+    if(sigaction(SIGUSR1, &sig, NULL) == -1) {
+        err(1, "could not set SIGUSR1 handler");
+    }
+
+    if(sigaction(SIGUSR2, &sig, NULL) == -1) {
+        err(1, "could not set SIGUSR2 handler");
+    }
+
+    if(sigaction(SIGHUP, &sig, NULL) == -1) {
+        err(1, "could not set SIGHUP handler");
+    }
+
+    if(sigaction(STATS_SIGNAL, &sig, NULL) == -1) {
+        err(1, "could not set stats signal handler");
+    }
+
+    if(sigaction(SIGCHLD, &sig, NULL) == -1) {
+        err(1, "could not set SIGCHLD handler");
+    }
+}
+
+void stop_timeout_expired(struct timer *timer) {
+    struct child_state *child = timer->object;
+
+    system_message("Shutdown timeout for %s (%lli) has arrived, killing it.", child->name, (long long int)child->pid);
+
+    kill(-child->pid, SIGKILL);
+}
+
+// sends the termination signal, and SIGKILL if that is not enough in time, to
+// the child's whole process group, so that a shell does not sit waiting on
+// the command it started before acting on the signal
+void stop_child(struct child_state *child) {
+    int timeout = child->config->shutdown_timeout;
+
+    child->stopping = 1;
+    kill(-child->pid, child->config->termination_signal);
+
+    child->stop_timer.expire = stop_timeout_expired;
+    child->stop_timer.object = child;
+    timer_set(&child->stop_timer, (uint64_t)(timeout > 0 ? timeout : SHUTDOWN_TIMEOUT) * 1000);
+}
+
+// asks the next wave of children to exit, once the current one has
+void shutdown_next_wave() {
+    int found = 0;
+    int order = 0;
+
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        const struct child_state *child = &children[i];
+
+        if(!child->running) {
+            continue;
+        }
+
+        if(child->stopping) {
+            return;
+        }
+
+        if(!found || child->config->shutdown_order < order) {
+            found = 1;
+            order = child->config->shutdown_order;
+        }
+    }
+
+    for(int i = 0; i < INSTANCES_COUNT && found; i += 1) {
+        struct child_state *child = &children[i];
+
+        if(!child->running || child->config->shutdown_order != order) {
+            continue;
+        }
+
+        stop_child(child);
+    }
+}
+
+void stop_probe(struct child_state *child);
+
+void teardown() {
+    if(teardown_in_progress) {
+        return;
+    }
+
+    system_message("Asking all processes to exit.");
+
+    teardown_in_progress = 1;
+
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        timer_cancel(&children[i].restart_timer);
+        stop_probe(&children[i]);
+    }
+
+    shutdown_next_wave();
+}
+
+// stops the next children in a reload, for as long as the batch has room
+void reload_next_batch() {
+    int batch = 0;
+
+    if(teardown_in_progress) {
+        return;
+    }
+
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        if(children[i].reload == RELOAD_STOPPING || children[i].reload == RELOAD_STARTING) {
+            batch += 1;
+        }
+    }
+
+    for(int i = 0; i < INSTANCES_COUNT && batch < RELOAD_BATCH_SIZE; i += 1) {
+        struct child_state *child = &children[i];
+
+        if(child->reload != RELOAD_PENDING) {
+            continue;
+        }
+
+        // one that is down already comes back up as it is anyway
+        if(!child->running || child->stopping) {
+            child->reload = RELOAD_NONE;
+            continue;
+        }
+
+        system_message("Reloading %s (%lli).", child->name, (long long int)child->pid);
+        child->reload = RELOAD_STOPPING;
+        stop_child(child);
+        batch += 1;
+    }
+
+    if(batch == 0) {
+        reload_in_progress = 0;
+        system_message("Reload has finished.");
+    }
+}
+
+void reload_child_ready(struct child_state *child) {
+    child->reload = RELOAD_NONE;
+    reload_next_batch();
+}
+
+// starts a child again that was stopped by a reload, whatever its restart
+// policy, as it is taken to be ready once it passes its probe
+void restart_for_reload(struct child_state *child) {
+    child->reload = RELOAD_STARTING;
+
+    if(start_child(child) == -1) {
+        system_message("%s could not be restarted.", child->name);
+        teardown();
+    } else if(child->config->probe.kind == PROBE_NONE) {
+        reload_child_ready(child);
+    }
+}
+
+void begin_reload() {
+    int count = 0;
+
+    if(teardown_in_progress) {
+        system_message("Shutdown in progress, so not reloading.");
+        return;
+    }
+
+    if(reload_in_progress) {
+        system_message("Reload already in progress.");
+        return;
+    }
+
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        struct child_state *child = &children[i];
+
+        if(child->running && !child->stopping && !child->config->is_startup_check) {
+            child->reload = RELOAD_PENDING;
+            count += 1;
+        }
+    }
+
+    if(count == 0) {
+        system_message("Nothing to reload.");
+        return;
+    }
+
+    system_message("Reloading %i children, %i at a time.", count, RELOAD_BATCH_SIZE);
+    reload_in_progress = 1;
+    reload_next_batch();
+}
+
+void probe_close(struct probe_state *probe) {
+    if(probe->source.fd != -1) {
+        event_remove_source(&probe->source);
+        close(probe->source.fd);
+        probe->source.fd = -1;
+    }
+
+    probe->phase = PROBE_IDLE;
+}
+
+void stop_probe(struct child_state *child) {
+    child->probe.active = 0;
+    timer_cancel(&child->probe.timer);
+    probe_close(&child->probe);
+}
+
+void probe_passed(struct child_state *child) {
+    if(!probe_only(child->config)) {
+        system_message("%s has passed its probe.", child->name);
+        child->satisfied = 1;
+        schedule_children();
+
+        if(child->reload == RELOAD_STARTING) {
+            reload_child_ready(child);
+        }
+
+        return;
+    }
+
+    stop_probe(child);
+    system_message("Startup check %s has passed.", child->name);
+    child->satisfied = 1;
+    checks_pending -= 1;
+
+    if(checks_pending == 0) {
+        system_message("All startup checks have passed.");
+    }
+
+    schedule_children();
+}
+
+void probe_failed(struct child_state *child) {
+    stop_probe(child);
+
+    if(probe_only(child->config)) {
+        if(!teardown_in_progress) {
+            system_message("Startup check %s failed, shutting down.", child->name);
+        }
+
+        teardown();
+        return;
+    }
+
+    if(child->running && !child->stopping && !teardown_in_progress) {
+        system_message("%s has failed its probe, stopping it.", child->name);
+        stop_child(child);
+    }
+}
+
+// failures only count once a child has passed, as it may take a while to
+// come up, except for startup checks that are only a probe
+void finish_probe(struct child_state *child, int passed) {
+    const struct probe_configuration *config = &child->config->probe;
+    struct probe_state *probe = &child->probe;
+    int limit = config->failures > 0 ? config->failures : PROBE_FAILURES;
+
+    probe_close(probe);
+
+    if(passed) {
+        probe->failures = 0;
+
+        if(!probe->passed) {
+            probe->passed = 1;
+            probe_passed(child);
+        }
+    } else if(probe->passed || probe_only(child->config)) {
+        probe->failures += 1;
+
+        if(probe->failures >= limit) {
+            probe_failed(child);
+        }
+    }
+
+    if(probe->active) {
+        timer_set(&probe->timer, config->interval > 0 ? config->interval : PROBE_INTERVAL);
+    }
+}
+
+// the status code of an HTTP response, or -1
+int probe_response_status(const struct probe_state *probe) {
+    const char *response = &probe->response[0];
+
+    if(probe->received < 12 || memcmp(response, "HTTP/", 5) != 0 || response[8] != ' ') {
+        return -1;
+    }
+
+    for(int i = 9; i < 12; i += 1) {
+        if(response[i] < '0' || response[i] > '9') {
+            return -1;
+        }
+    }
+
+    return (response[9] - '0') * 100 + (response[10] - '0') * 10 + (response[11] - '0');
+}
+
+void probe_connected(struct child_state *child) {
+    const struct probe_configuration *config = &child->config->probe;
+    struct probe_state *probe = &child->probe;
+    char request[512];
+
+    if(config->kind != PROBE_HTTP) {
+        finish_probe(child, 1);
+        return;
+    }
+
+    int length = snprintf(&request[0], sizeof(request), "GET %s HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n", config->path != NULL ? config->path : "/", config->target);
+
+    // a request this small fits in a new connection's send buffer
+    if(length < 0 || (size_t)length >= sizeof(request) || send(probe->source.fd, &request[0], length, MSG_NOSIGNAL) != length) {
+        finish_probe(child, 0);
+        return;
+    }
+
+    event_remove_source(&probe->source);
+    probe->source.events = EVENT_READ;
+    probe->phase = PROBE_RECEIVING;
+    probe->received = 0;
+
+    if(event_add(&probe->source) == -1) {
+        finish_probe(child, 0);
+    }
+}
+
+void begin_probe(struct child_state *child) {
+    const struct probe_configuration *config = &child->config->probe;
+    struct probe_state *probe = &child->probe;
+
+    if(config->kind == PROBE_FILE) {
+        finish_probe(child, access(config->target, F_OK) == 0);
+        return;
+    }
+
+    int fd = socket(probe->address.ss_family, SOCK_STREAM, 0);
+
+    if(fd == -1) {
+        finish_probe(child, 0);
+        return;
+    }
+
+    if(fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 || fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+        close(fd);
+        finish_probe(child, 0);
+        return;
+    }
+
+#ifdef SO_NOSIGPIPE
+    int one = 1;
+
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+    probe->source = (struct event_source){ .fd = fd, .flavour = FLAVOUR_PROBE, .events = EVENT_WRITE, .index = -1, .object = child };
+    probe->phase = PROBE_CONNECTING;
+    timer_set(&probe->timer, config->timeout > 0 ? config->timeout : PROBE_TIMEOUT);
+
+    if(connect(fd, (struct sockaddr *)&probe->address, probe->address_length) == 0) {
+        probe_connected(child);
+        return;
+    }
+
+    if(errno != EINPROGRESS || event_add(&probe->source) == -1) {
+        finish_probe(child, 0);
+    }
+}
+
+// either the next attempt is due, or the current one has timed out
+void probe_expired(struct timer *timer) {
+    struct child_state *child = timer->object;
+
+    if(child->probe.phase == PROBE_IDLE) {
+        begin_probe(child);
+    } else {
+        finish_probe(child, 0);
+    }
+}
+
+void handle_probe(struct child_state *child) {
+    struct probe_state *probe = &child->probe;
+
+    if(probe->phase == PROBE_CONNECTING) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+
+        if(getsockopt(probe->source.fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+            finish_probe(child, 0);
+        } else {
+            probe_connected(child);
+        }
+
+        return;
+    }
+
+    char rest[512];
+    int full = probe->received == sizeof(probe->response);
+
+    // the status line is all that is looked at, but the rest is read until
+    // the server closes, as closing with it unread would reset the connection
+    ssize_t bytes_read = full ? recv(probe->source.fd, &rest[0], sizeof(rest), 0)
+        : recv(probe->source.fd, &probe->response[probe->received], sizeof(probe->response) - probe->received, 0);
+
+    if(bytes_read == -1) {
+        if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            finish_probe(child, 0);
+        }
+
+        return;
+    }
+
+    if(!full) {
+        probe->received += bytes_read;
+    }
+
+    if(bytes_read == 0) {
+        int expected = child->config->probe.status > 0 ? child->config->probe.status : 200;
+
+        finish_probe(child, probe_response_status(probe) == expected);
+    }
+}
+
+void start_probe(struct child_state *child) {
+    struct probe_state *probe = &child->probe;
+
+    if(child->config->probe.kind == PROBE_NONE) {
+        return;
+    }
+
+    probe->active = 1;
+    probe->passed = 0;
+    probe->failures = 0;
+    probe->timer.expire = probe_expired;
+    probe->timer.object = child;
+    timer_set(&probe->timer, 0);
+}
+
+__attribute__((noreturn))
+void brutal_teardown() {
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        if(children[i].running) {
+            kill(-children[i].pid, SIGKILL);
+        }
+    }
+
+    finish_outputs();
+    exit(1);
+}
+
+struct child_state *reap(pid_t pid, int exit_status) {
+    struct child_state *child = pid_table_find(pid);
+
+    if(child == NULL) {
+        return NULL;
+    }
+
+    pid_table_remove(child);
+    child->pid = -1;
+    child->running = 0;
+    child->stopping = 0;
+    child->has_exited = 1;
+    child->exit_status = exit_status;
+    timer_cancel(&child->stop_timer);
+    stop_probe(child);
+
+#if IO_WORKERS > 0
+    send_worker_command(worker_for(child), WORKER_CLOSE, child, NULL);
+#else
+    close_streams(child);
+#endif
+
+    if(child->config->is_startup_check) {
+        if(exit_status == 0) {
+            system_message("Process for %s (%lli) has indicated success.", child->name, (long long int)pid);
+        } else {
+            system_message("Process for %s (%lli) has indicated failure.", child->name, (long long int)pid);
+        }
+    } else {
+        system_message("Process for %s (%lli) has exited.", child->name, (long long int)pid);
+    }
+
+    return child;
+}
+
+// the portable byte at a time form of clean_span(), which finishes what the
+// wider scans leave
+size_t clean_span_scalar(const unsigned char *data, size_t length) {
+    size_t i = 0;
+
+    for(; i < length; i += 1) {
+        if(data[i] < ' ' || data[i] == 127 || (SCRUB_ESCAPES && (data[i] == '"' || data[i] == '\\'))) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+// returns how many leading bytes need no scrubbing, i.e. are neither
+// control characters nor DEL, nor quotes or backslashes when those are escaped
+size_t clean_span(const unsigned char *data, size_t length) {
+    size_t i = 0;
+
+#if !SCALAR_LINE_SCANNER && defined(__SSE2__)
+    const __m128i limit = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+
+    for(; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(block, limit), block);
+        __m128i special = _mm_or_si128(control, _mm_cmpeq_epi8(block, del));
+
+        if(SCRUB_ESCAPES) {
+            special = _mm_or_si128(special, _mm_cmpeq_epi8(block, _mm_set1_epi8('"')));
+            special = _mm_or_si128(special, _mm_cmpeq_epi8(block, _mm_set1_epi8('\\')));
+        }
+
+        int mask = _mm_movemask_epi8(special);
+
+        if(mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#elif !SCALAR_LINE_SCANNER && defined(__ARM_NEON)
+    const uint8x16_t limit = vdupq_n_u8(0x20);
+    const uint8x16_t del = vdupq_n_u8(0x7f);
+
+    for(; i + 16 <= length; i += 16) {
+        uint8x16_t block = vld1q_u8(data + i);
+        uint8x16_t special = vorrq_u8(vcltq_u8(block, limit), vceqq_u8(block, del));
+
+        if(SCRUB_ESCAPES) {
+            special = vorrq_u8(special, vceqq_u8(block, vdupq_n_u8('"')));
+            special = vorrq_u8(special, vceqq_u8(block, vdupq_n_u8('\\')));
+        }
+
+        // narrow to one nibble per byte so the result fits a 64-bit lane
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(special), 4)), 0);
+
+        if(mask != 0) {
+            return i + __builtin_ctzll(mask) / 4;
+        }
+    }
+#elif !SCALAR_LINE_SCANNER
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+
+    for(; i + 8 <= length; i += 8) {
+        uint64_t word;
+
+        memcpy(&word, data + i, 8);
+
+        // a high bit is set for some byte below 0x20 or equal to 0x7f
+        uint64_t del = word ^ (ones * 0x7f);
+        uint64_t special = ((word - ones * 0x20) & ~word) | ((del - ones) & ~del);
+
+        if(SCRUB_ESCAPES) {
+            uint64_t quote = word ^ (ones * '"');
+            uint64_t backslash = word ^ (ones * '\\');
+
+            special |= ((quote - ones) & ~quote) | ((backslash - ones) & ~backslash);
+        }
+
+        if((special & highs) != 0) {
+            break;
+        }
+    }
+#endif
+
+    return i + clean_span_scalar(data + i, length - i);
+}
+
+// what each byte clean_span stops at is written as
+struct scrub_replacement {
+    char text[2];
+    unsigned char length;
+};
+
+const struct scrub_replacement scrub_replacements[256] = {
+    [0 ... '\r' - 1] = { " ", 1 },
+    ['\r'] = { "", 0 },
+    ['\r' + 1 ... 31] = { " ", 1 },
+    [127] = { " ", 1 },
+#if SCRUB_ESCAPES
+    ['"'] = { "\\\"", 2 },
+    ['\\'] = { "\\\\", 2 },
+#endif
+};
+
+// copies a line while dropping carriage returns, replacing other control
+// characters with spaces and escaping quotes and backslashes for structured
+// formats, returning how many bytes were written; destination may be the same
+// as source only when nothing is escaped
+size_t copy_scrubbed(char *destination, const char *source, size_t length) {
+    const char *end = source + length;
+    char *outp = destination;
+
+    while(source < end) {
+        size_t clean = clean_span((const unsigned char *)source, end - source);
+
+        if(outp != source) {
+            memmove(outp, source, clean);
+        }
+        outp += clean;
+        source += clean;
+
+        if(source == end) {
+            break;
+        }
+
+        const struct scrub_replacement *replacement = &scrub_replacements[(unsigned char)*source];
+
+        memcpy(outp, &replacement->text[0], replacement->length);
+        outp += replacement->length;
+        source += 1;
+    }
+
+    return outp - destination;
+}
+
+#ifdef SUPERVISOR_BENCHMARK
+THREAD_LOCAL uint64_t bench_lines;
+uint64_t bench_bytes;
+THREAD_LOCAL struct histogram bench_latency;
+
+void bench_record_flush(struct output *output) {
+    uint64_t now = monotonic_ns();
+
+    for(int i = 0; i < output->bench_line_count; i += 1) {
+        if(output->bench_stamps[i] != 0 && output->bench_stamps[i] <= now) {
+            histogram_record(&bench_latency, now - output->bench_stamps[i]);
+        }
+    }
+
+    bench_lines += output->bench_line_count;
+    output->bench_line_count = 0;
+}
+
+// lines from synthetic children start with the time they were written, in hex
+void bench_record_line(struct output *output, const char *line, size_t length) {
+    uint64_t stamp = 0;
+
+    for(size_t i = 0; i < 16 && i < length; i += 1) {
+        char c = line[i];
+
+        if(c >= '0' && c <= '9') {
+            stamp = stamp * 16 + (c - '0');
+        } else if(c >= 'a' && c <= 'f') {
+            stamp = stamp * 16 + (c - 'a' + 10);
+        } else {
+            stamp = 0;
+            break;
+        }
+    }
+
+    output->bench_stamps[output->bench_line_count] = stamp;
+    output->bench_line_count += 1;
+}
+#endif
+
+size_t output_queued(const struct output *output) {
+    return output->queue_tail - output->queue_head;
+}
+
+// registers for writability only while there is something to wait for
+void update_output_interest(struct output *output) {
+    if(output_queued(output) > 0 && output->source.index == -1) {
+        event_add(&output->source);
+    } else if(output_queued(output) == 0 && output->source.index != -1) {
+        event_remove_source(&output->source);
+    }
+}
+
+// moves the queued bytes to the front, so that the rest of it is free at the back
+void compact_queue(struct output *output) {
+    size_t queued = output_queued(output);
+
+    memmove(&output->queue[0], &output->queue[output->queue_head], queued);
+    output->queue_head = 0;
+    output->queue_tail = queued;
+}
+
+unsigned long long count_lines(const char *data, size_t length) {
+    unsigned long long lines = 0;
+    const char *end = data + length;
+
+    while((data = memchr(data, '\n', end - data)) != NULL) {
+        lines += 1;
+        data += 1;
+    }
+
+    return lines;
+}
+
+// adds the marker reporting dropped lines, once it can start a line of its own
+void queue_loss_marker(struct output *output) {
+    char marker[200];
+
+    if(output->lines_unreported == 0) {
+        return;
+    }
+
+    if(output_queued(output) > 0 ? output->queue[output->queue_tail - 1] != '\n' : output->line_open) {
+        return;
+    }
+
+    int length = snprintf(&marker[0], sizeof(marker), "%.*s%s%llu lines were dropped while the destination was not ready.%s",
+        TIMESTAMP_FORMAT == TIMESTAMP_NONE ? 0 : (int)line_clock.length, &line_clock.text[0],
+        system_prefix.text, output->lines_unreported, LINE_END);
+
+    if(OUTPUT_QUEUE_SIZE - output_queued(output) < (size_t)length) {
+        return;
+    }
+
+    if(output->queue_tail + length > OUTPUT_QUEUE_SIZE) {
+        compact_queue(output);
+    }
+
+    memcpy(&output->queue[output->queue_tail], &marker[0], length);
+    output->queue_tail += length;
+    output->lines_unreported = 0;
+}
+
+// writes as much of the queue as the destination takes without blocking
+void drain_queue(struct output *output) {
+    while(output_queued(output) > 0) {
+        ssize_t bytes_written = write(output->fd, &output->queue[output->queue_head], output_queued(output));
+
+        if(bytes_written == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                // nothing more can be written there, as with a blocking write
+                output->queue_head = output->queue_tail;
+            }
+
+            break;
+        }
+
+#ifdef SUPERVISOR_BENCHMARK
+        bench_bytes += bytes_written;
+#endif
+
+        output->queue_head += bytes_written;
+        output->line_open = output->queue[output->queue_head - 1] != '\n';
+    }
+
+    if(output_queued(output) == 0) {
+        output->queue_head = 0;
+        output->queue_tail = 0;
+    }
+
+    if(OUTPUT_OVERFLOW_POLICY == OUTPUT_OVERFLOW_DROP_MARKED) {
+        queue_loss_marker(output);
+    }
+
+    if(output->congested && output_queued(output) <= OUTPUT_QUEUE_SIZE / 4) {
+        output->congested = 0;
+        resume_output(output);
+    }
+
+    update_output_interest(output);
+}
+
+// drops whole lines from the front of the queue to free at least the given
+// number of bytes, keeping the line the destination has partly received
+void drop_oldest(struct output *output, size_t needed) {
+    char *head = &output->queue[output->queue_head];
+    char *tail = &output->queue[output->queue_tail];
+    size_t keep = 0;
+
+    if(output->line_open) {
+        char *newline = memchr(head, '\n', tail - head);
+
+        if(newline == NULL) {
+            return;
+        }
+
+        keep = newline + 1 - head;
+    }
+
+    // dropping a good part of the queue at once keeps compaction rare
+    if(needed < OUTPUT_QUEUE_SIZE / 4) {
+        needed = OUTPUT_QUEUE_SIZE / 4;
+    }
+
+    char *from = head + keep;
+    char *to = tail;
+
+    if((size_t)(tail - from) > needed) {
+        char *newline = memchr(from + needed, '\n', tail - from - needed);
+
+        if(newline != NULL) {
+            to = newline + 1;
+        }
+    }
+
+    output->lines_dropped += count_lines(from, to - from);
+
+    memmove(to - keep, head, keep);
+    output->queue_head = to - keep - &output->queue[0];
+}
+
+// keeps what the destination did not take, dropping lines if the queue is full
+void queue_remainder(struct output *output, const struct iovec *iov, int iov_count) {
+    size_t total = 0;
+
+    for(int i = 0; i < iov_count; i += 1) {
+        total += iov[i].iov_len;
+    }
+
+    if(OUTPUT_OVERFLOW_POLICY == OUTPUT_OVERFLOW_DROP_OLDEST && total > OUTPUT_QUEUE_SIZE - output_queued(output)) {
+        drop_oldest(output, total - (OUTPUT_QUEUE_SIZE - output_queued(output)));
+    }
+
+    if(output->queue_tail + total > OUTPUT_QUEUE_SIZE) {
+        compact_queue(output);
+    }
+
+    size_t start = output->queue_tail;
+    int i = 0;
+
+    for(; i < iov_count; i += 1) {
+        size_t length = iov[i].iov_len;
+        size_t space = OUTPUT_QUEUE_SIZE - output->queue_tail;
+
+        if(length > space) {
+            break;
+        }
+
+        memcpy(&output->queue[output->queue_tail], iov[i].iov_base, length);
+        output->queue_tail += length;
+    }
+
+    if(i < iov_count) {
+        unsigned long long lines = 0;
+
+        // only whole lines are kept, so back up to the last one that fits
+        while(output->queue_tail > start && output->queue[output->queue_tail - 1] != '\n') {
+            output->queue_tail -= 1;
+        }
+
+        // the bytes backed out belong to the first line counted here
+        for(int j = i; j < iov_count; j += 1) {
+            lines += count_lines(iov[j].iov_base, iov[j].iov_len);
+        }
+
+        // a line cut short is still ended, so the next one starts cleanly
+        int cut = output_queued(output) > 0 ? output->queue[output->queue_tail - 1] != '\n' : output->line_open;
+
+        if(cut && output->queue_tail < OUTPUT_QUEUE_SIZE) {
+            output->queue[output->queue_tail] = '\n';
+            output->queue_tail += 1;
+        }
+
+        output->lines_dropped += lines;
+        output->lines_unreported += lines;
+    }
+
+    if(OUTPUT_OVERFLOW_POLICY == OUTPUT_OVERFLOW_BLOCK && output_queued(output) > OUTPUT_QUEUE_SIZE / 2) {
+        output->congested = 1;
+    }
+
+    update_output_interest(output);
+}
+
+void wait_writable(struct output *output) {
+    struct pollfd entry = { .fd = output->fd, .events = POLLOUT };
+
+    while(poll(&entry, 1, -1) == -1 && errno == EINTR) {}
+}
+
+int open_log_file(struct log_file *log, int flags) {
+    struct stat status;
+
+    log->fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | flags, 0644);
+
+    if(log->fd == -1) {
+        return -1;
+    }
+
+    log->size = fstat(log->fd, &status) == 0 ? (uint64_t)status.st_size : 0;
+    log->opened_at = timer_ticks();
+    return 0;
+}
+
+// writes the buffer out, dropping whatever the file does not take
+void write_log_buffer(struct log_file *log) {
+    size_t written = 0;
+
+    while(written < log->used && log->fd != -1) {
+        ssize_t bytes_written = write(log->fd, &log->buffer[written], log->used - written);
+
+        if(bytes_written == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(!log->failing) {
+                warn("write() to %s", log->path);
+                log->failing = 1;
+            }
+
+            break;
+        }
+
+        written += bytes_written;
+        log->failing = 0;
+    }
+
+    if(written < log->used) {
+        log->output->lines_dropped += count_lines(&log->buffer[written], log->used - written);
+    }
+
+    log->size += written;
+    log->dirty |= written > 0;
+    log->used = 0;
+}
+
+// log files are synced by a helper process, so that the event loop never
+// waits on the disk; each descriptor passed to it is its own copy, which it
+// closes once synced, so a file can be closed here at any time after
+pid_t sync_helper = -1;
+int sync_socket = -1;
+
+__attribute__((noreturn))
+void run_sync_helper(int fd) {
+    int signals[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGUSR1, SIGUSR2 };
+
+    // signals for the supervisor reach it too, from a terminal; it goes once
+    // the supervisor closes its end, having synced everything passed so far
+    for(size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i += 1) {
+        signal(signals[i], SIG_IGN);
+    }
+
+#ifdef __OpenBSD__
+    if(pledge("stdio recvfd", NULL) == -1) {
+        _exit(1);
+    }
+#endif
+
+    while(1) {
+        char byte;
+        char control[CMSG_SPACE(sizeof(int))];
+        struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+        struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = &control[0], .msg_controllen = sizeof(control) };
+        ssize_t received = recvmsg(fd, &message, 0);
+
+        if(received == 0) {
+            _exit(0);
+        } else if(received == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            _exit(1);
+        }
+
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+
+        if(header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            int file;
+
+            memcpy(&file, CMSG_DATA(header), sizeof(file));
+            fdatasync(file);
+            close(file);
+        }
+    }
+}
+
+// after the supervisor has its cgroup, and before any threads are started
+void start_sync_helper() {
+    int fds[2];
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        err(1, "could not create a socket pair for the sync helper");
+    }
+
+    sync_helper = fork();
+
+    if(sync_helper == -1) {
+        err(1, "could not start the sync helper");
+    } else if(sync_helper == 0) {
+        close(fds[0]);
+        run_sync_helper(fds[1]);
+    }
+
+    close(fds[1]);
+    sync_socket = fds[0];
+
+    if(fcntl(sync_socket, F_SETFD, FD_CLOEXEC) == -1 || fcntl(sync_socket, F_SETFL, O_NONBLOCK) == -1) {
+        err(1, "fcntl() for the sync helper");
+    }
+}
+
+// waits for whatever has been passed to the helper to be synced
+void stop_sync_helper() {
+    if(sync_socket == -1) {
+        return;
+    }
+
+    close(sync_socket);
+    sync_socket = -1;
+
+    while(waitpid(sync_helper, NULL, 0) == -1 && errno == EINTR) {}
+
+    sync_helper = -1;
+}
+
+// the helper has a copy of fd synced and closed, or -1 is returned
+int pass_to_sync_helper(int fd) {
+    char byte = 0;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    struct msghdr message = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = &control[0], .msg_controllen = sizeof(control) };
+
+    if(sync_socket == -1) {
+        errno = EBADF;
+        return -1;
+    }
+
+    bzero(&control[0], sizeof(control));
+
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &fd, sizeof(fd));
+
+    ssize_t sent;
+
+    do {
+        sent = sendmsg(sync_socket, &message, MSG_NOSIGNAL);
+    } while(sent == -1 && errno == EINTR);
+
+    return sent == 1 ? 0 : -1;
+}
+
+void sync_log_file(struct log_file *log) {
+    if(!log->dirty || log->fd == -1) {
+        return;
+    }
+
+    // a helper that is this far behind catches up on the next sync; without
+    // one, the file is synced here after all
+    if(pass_to_sync_helper(log->fd) == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+        fdatasync(log->fd);
+    }
+
+    log->dirty = 0;
+}
+
+// moves the file to path.1, what was there to path.2 and so on, and starts a
+// new one; only names change, so this takes a few system calls however large
+// the file has grown
+void rotate_log_file(struct log_file *log) {
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+
+    write_log_buffer(log);
+
+    // the outgoing file is handed to the sync helper rather than waited on
+    if(log->fd != -1) {
+        if(LOG_FILE_SYNC_INTERVAL > 0) {
+            sync_log_file(log);
+        }
+
+        close(log->fd);
+    }
+
+    for(int i = LOG_FILE_ROTATE_KEEP; i > 0; i -= 1) {
+        if(i > 1) {
+            snprintf(&from[0], sizeof(from), "%s.%i", log->path, i - 1);
+        } else {
+            snprintf(&from[0], sizeof(from), "%s", log->path);
+        }
+
+        snprintf(&to[0], sizeof(to), "%s.%i", log->path, i);
+
+        if(rename(&from[0], &to[0]) == -1 && errno != ENOENT) {
+            warn("rename(%s, %s)", &from[0], &to[0]);
+        }
+    }
+
+    // with nothing kept, the file is started again in place
+    if(open_log_file(log, LOG_FILE_ROTATE_KEEP == 0 ? O_TRUNC : 0) == -1) {
+        warn("open(%s)", log->path);
+    }
+
+    log->dirty = 0;
+}
+
+// what a flush of a log file's output does instead of writing
+void append_log_file(struct log_file *log, const struct iovec *iov, int iov_count) {
+    for(int i = 0; i < iov_count; i += 1) {
+        const char *data = iov[i].iov_base;
+        size_t length = iov[i].iov_len;
+
+        while(length > 0) {
+            if(log->used == LOG_FILE_BUFFER_SIZE) {
+                write_log_buffer(log);
+            }
+
+            size_t piece = LOG_FILE_BUFFER_SIZE - log->used;
+
+            if(piece > length) {
+                piece = length;
+            }
+
+            memcpy(&log->buffer[log->used], data, piece);
+            log->used += piece;
+            data += piece;
+            length -= piece;
+        }
+
+        if(iov[i].iov_len > 0) {
+            log->line_open = ((const char *)iov[i].iov_base)[iov[i].iov_len - 1] != '\n';
+        }
+    }
+
+    if(LOG_FILE_ROTATE_SIZE > 0 && !log->line_open && log->size + log->used >= (uint64_t)LOG_FILE_ROTATE_SIZE) {
+        rotate_log_file(log);
+    }
+}
+
+void log_flush_expired(struct timer *timer) {
+    uint64_t now = timer_ticks();
+
+    for(int i = 0; i < log_file_count; i += 1) {
+        struct log_file *log = &log_files[i];
+
+        // a file that could not be opened is tried again, having lost what came in between
+        if(log->fd == -1 && open_log_file(log, 0) == 0) {
+            warnx("%s could be opened again", log->path);
+        }
+
+        if(LOG_FILE_ROTATE_INTERVAL > 0 && !log->line_open && now >= log->opened_at + (uint64_t)LOG_FILE_ROTATE_INTERVAL * 1000) {
+            rotate_log_file(log);
+        } else {
+            write_log_buffer(log);
+        }
+    }
+
+    timer_set(timer, LOG_FILE_FLUSH_INTERVAL);
+}
+
+// syncing all files at an interval rather than after each write bounds how
+// much can be lost, and the helper does the waiting on the disk
+void log_sync_expired(struct timer *timer) {
+    for(int i = 0; i < log_file_count; i += 1) {
+        write_log_buffer(&log_files[i]);
+        sync_log_file(&log_files[i]);
+    }
+
+    timer_set(timer, LOG_FILE_SYNC_INTERVAL);
+}
+
+// files are opened before the file system is hidden, and children naming the
+// same path share one
+void open_log_files() {
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        const char *path = children[i].config->log_file;
+        struct log_file *log = NULL;
+
+        if(path == NULL) {
+            continue;
+        }
+
+        for(int j = 0; j < log_file_count; j += 1) {
+            if(strcmp(log_files[j].path, path) == 0) {
+                log = &log_files[j];
+            }
+        }
+
+        if(log == NULL) {
+            log = &log_files[log_file_count];
+            log->path = path;
+            log->buffer = malloc(LOG_FILE_BUFFER_SIZE);
+            log->output = calloc(1, sizeof(struct output));
+
+            if(log->buffer == NULL || log->output == NULL) {
+                err(1, "malloc");
+            }
+
+            if(open_log_file(log, 0) == -1) {
+                err(1, "open(%s)", path);
+            }
+
+            // never spliced into, as that would overtake the buffer
+            log->output->fd = -1;
+            log->output->original_flags = -1;
+            log->output->source = (struct event_source){ .fd = -1, .index = -1 };
+            log->output->log = log;
+            log->destination = destination_count;
+            destinations[destination_count] = log->output;
+            destination_count += 1;
+            log_file_count += 1;
+        }
+
+        children[i].log = log;
+    }
+}
+
+#if IO_WORKERS > 0
+void ring_doorbell(struct worker *worker) {
+    if(!atomic_exchange(&worker->doorbell_rung, 1)) {
+        write(worker->doorbell_w, "x", 1);
+    }
+}
+
+// lets the main thread know there is something to take, then sleeps until
+// it has taken some of it
+void wait_for_room(struct worker *worker, struct ring *ring, size_t tail) {
+    ring_doorbell(worker);
+
+    while(1) {
+        atomic_store(&worker->wants_wake, 1);
+
+        if(tail - atomic_load(&ring->head) < IO_WORKER_RING_SIZE) {
+            return;
+        }
+
+        struct pollfd entry = { .fd = worker->wake_r, .events = POLLIN };
+        char dummy[64];
+
+        // a command woken for is looked at once the worker loop comes round
+        if(poll(&entry, 1, -1) > 0) {
+            read(worker->wake_r, &dummy[0], sizeof(dummy));
+        }
+    }
+}
+
+// copies what a worker has staged into its ring to the main thread
+void push_to_ring(struct output *output, const struct iovec *iov, int iov_count) {
+    struct ring *ring = output->ring;
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    for(int i = 0; i < iov_count; i += 1) {
+        const char *base = iov[i].iov_base;
+        size_t length = iov[i].iov_len;
+
+        while(length > 0) {
+            size_t room = IO_WORKER_RING_SIZE - (tail - atomic_load_explicit(&ring->head, memory_order_acquire));
+
+            if(room == 0) {
+                atomic_store_explicit(&ring->tail, tail, memory_order_release);
+                wait_for_room(output->worker, ring, tail);
+                continue;
+            }
+
+            size_t offset = tail & (IO_WORKER_RING_SIZE - 1);
+            size_t piece = IO_WORKER_RING_SIZE - offset;
+
+            if(piece > room) {
+                piece = room;
+            }
+
+            if(piece > length) {
+                piece = length;
+            }
+
+            memcpy(&ring->data[offset], base, piece);
+            tail += piece;
+            base += piece;
+            length -= piece;
+        }
+    }
+
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    output->worker->pushed = 1;
+
+    // streams are held back in the worker as they would be by a full queue
+    if(OUTPUT_OVERFLOW_POLICY == OUTPUT_OVERFLOW_BLOCK && tail - atomic_load_explicit(&ring->head, memory_order_relaxed) > IO_WORKER_RING_SIZE / 2) {
+        output->congested = 1;
+    }
+}
+#endif
+
+void flush_output(struct output *output) {
+    struct iovec *iov = &output->iov[0];
+    int iov_count = output->iov_count;
+
+    if(output->log != NULL) {
+        append_log_file(output->log, iov, iov_count);
+        output->iov_count = 0;
+        output->used = 0;
+#ifdef SUPERVISOR_BENCHMARK
+        bench_record_flush(output);
+#endif
+        return;
+    }
+
+#if IO_WORKERS > 0
+    if(output->ring != NULL) {
+        push_to_ring(output, iov, iov_count);
+        output->iov_count = 0;
+        output->used = 0;
+#ifdef SUPERVISOR_BENCHMARK
+        bench_record_flush(output);
+#endif
+        return;
+    }
+#endif
+
+    if(output_queued(output) > 0) {
+        drain_queue(output);
+    }
+
+    while(iov_count > 0) {
+        // queued output has to go first
+        if(output_queued(output) == 0) {
+            ssize_t bytes_written = writev(output->fd, iov, iov_count);
+
+            if(bytes_written == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+
+                if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                    iov_count = 0;
+                    break;
+                }
+            } else {
+#ifdef SUPERVISOR_BENCHMARK
+                bench_bytes += bytes_written;
+#endif
+
+                while(iov_count > 0 && (size_t)bytes_written >= iov->iov_len) {
+                    if(iov->iov_len > 0) {
+                        output->line_open = ((char *)iov->iov_base)[iov->iov_len - 1] != '\n';
+                    }
+
+                    bytes_written -= iov->iov_len;
+                    iov += 1;
+                    iov_count -= 1;
+                }
+
+                if(iov_count > 0 && bytes_written > 0) {
+                    iov->iov_base = (char *)iov->iov_base + bytes_written;
+                    iov->iov_len -= bytes_written;
+                    output->line_open = ((char *)iov->iov_base)[-1] != '\n';
+                }
+
+                continue;
+            }
+        }
+
+        if(OUTPUT_OVERFLOW_POLICY != OUTPUT_OVERFLOW_BLOCK) {
+            break;
+        }
+
+        size_t remainder = 0;
+
+        for(int i = 0; i < iov_count; i += 1) {
+            remainder += iov[i].iov_len;
+        }
+
+        if(remainder <= OUTPUT_QUEUE_SIZE - output_queued(output)) {
+            break;
+        }
+
+        // more was produced in one go than the queue holds, which is the one
+        // case where the supervisor still waits for the destination
+        wait_writable(output);
+        drain_queue(output);
+    }
+
+    if(iov_count > 0) {
+        queue_remainder(output, iov, iov_count);
+    }
+
+    output->iov_count = 0;
+    output->used = 0;
+
+#ifdef SUPERVISOR_BENCHMARK
+    bench_record_flush(output);
+#endif
+}
+
+void flush_outputs() {
+    for(int i = 0; i < destination_count; i += 1) {
+        flush_output(destinations[i]);
+    }
+}
+
+// the process that registered restore_output_flags(); forked children
+// inherit the handler along with the shared descriptors
+pid_t output_flags_owner = -1;
+
+void restore_output_flags() {
+    struct output *outputs[2] = { &output_stdout, &output_stderr };
+
+    if(getpid() != output_flags_owner) {
+        return;
+    }
+
+    for(int i = 0; i < 2; i += 1) {
+        if(outputs[i]->original_flags != -1) {
+            fcntl(outputs[i]->fd, F_SETFL, outputs[i]->original_flags);
+            outputs[i]->original_flags = -1;
+        }
+    }
+}
+
+// destinations are written without blocking, so a stalled reader cannot
+// stall supervision; the original flags are put back on exit, as they are
+// shared with whatever else holds the same file open
+void setup_outputs() {
+    struct output *outputs[2] = { &output_stdout, &output_stderr };
+
+    for(int i = 0; i < 2; i += 1) {
+        int flags = fcntl(outputs[i]->fd, F_GETFL);
+
+        if(flags == -1 || (flags & O_NONBLOCK)) {
+            continue;
+        }
+
+        if(fcntl(outputs[i]->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            warn("fcntl(%i, F_SETFL, O_NONBLOCK)", outputs[i]->fd);
+            continue;
+        }
+
+        outputs[i]->original_flags = flags;
+    }
+
+    output_flags_owner = getpid();
+
+    if(atexit(restore_output_flags) != 0) {
+        errx(1, "could not register exit handler");
+    }
+}
+
+// gives queued output up to SHUTDOWN_TIMEOUT to be written before exiting
+void finish_outputs() {
+    struct output *outputs[2] = { &output_stdout, &output_stderr };
+    uint64_t deadline = monotonic_ns() + (uint64_t)SHUTDOWN_TIMEOUT * 1000000000ULL;
+
+#if IO_WORKERS > 0
+    drain_workers(1);
+#endif
+    flush_outputs();
+
+    for(int i = 0; i < log_file_count; i += 1) {
+        write_log_buffer(&log_files[i]);
+
+        if(LOG_FILE_SYNC_INTERVAL > 0) {
+            sync_log_file(&log_files[i]);
+        }
+    }
+
+    stop_sync_helper();
+
+    for(int i = 0; i < 2; i += 1) {
+        while(output_queued(outputs[i]) > 0) {
+            uint64_t now = monotonic_ns();
+            struct pollfd entry = { .fd = outputs[i]->fd, .events = POLLOUT };
+
+            if(now >= deadline) {
+                return;
+            }
+
+            if(poll(&entry, 1, (deadline - now) / 1000000 + 1) == -1 && errno != EINTR) {
+                return;
+            }
+
+            drain_queue(outputs[i]);
+        }
+    }
+}
+
+void update_line_clock() {
+    struct timespec now;
+
+    if(TIMESTAMP_FORMAT == TIMESTAMP_NONE) {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    long long millisecond = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    if(millisecond == line_clock.millisecond) {
+        return;
+    }
+
+    line_clock.millisecond = millisecond;
+
+    if(TIMESTAMP_FORMAT == TIMESTAMP_EPOCH_MS) {
+        line_clock.length = snprintf(&line_clock.text[0], sizeof(line_clock.text), "%s%lld%s", CLOCK_OPEN, millisecond, CLOCK_CLOSE);
+        return;
+    }
+
+    if(now.tv_sec != line_clock.second) {
+        struct tm fields;
+        size_t open = strlen(CLOCK_OPEN);
+
+        line_clock.second = now.tv_sec;
+        gmtime_r(&now.tv_sec, &fields);
+        memcpy(&line_clock.text[0], CLOCK_OPEN, open);
+        line_clock.second_length = open + strftime(&line_clock.text[open], sizeof(line_clock.text) - open - 8, "%Y-%m-%dT%H:%M:%S.", &fields);
+    }
+
+    char *digits = &line_clock.text[line_clock.second_length];
+    int fraction = now.tv_nsec / 1000000;
+
+    digits[0] = '0' + fraction / 100;
+    digits[1] = '0' + fraction / 10 % 10;
+    digits[2] = '0' + fraction % 10;
+    digits[3] = 'Z';
+    memcpy(&digits[4], CLOCK_CLOSE, strlen(CLOCK_CLOSE));
+    line_clock.length = line_clock.second_length + 4 + strlen(CLOCK_CLOSE);
+}
+
+void queue_iovec(struct output *output, const char *base, size_t length) {
+    output->iov[output->iov_count].iov_base = (char *)base;
+    output->iov[output->iov_count].iov_len = length;
+    output->iov_count += 1;
+}
+
+// stages text too large to stage at once in pieces, as escaping it in place
+// could overwrite what is still to be read
+void queue_in_pieces(struct output *output, const char *text, size_t length) {
+    while(length > 0) {
+        size_t room = (OUTPUT_BATCH_SIZE - output->used) / SCRUB_EXPANSION;
+
+        // the line end has to fit after the last piece
+        if(room == 0 || output->iov_count + 2 > OUTPUT_IOV_COUNT) {
+            flush_output(output);
+            continue;
+        }
+
+        size_t piece = length < room ? length : room;
+        size_t scrubbed = copy_scrubbed(&output->data[output->used], text, piece);
+
+        queue_iovec(output, &output->data[output->used], scrubbed);
+        output->used += scrubbed;
+        text += piece;
+        length -= piece;
+    }
+}
+
+// queues part of a line, with the prefix when there is one and the line end
+// when ends_line is set; text too large to stage is scrubbed in place and
+// written straight away
+void queue_text(struct output *output, const struct line_prefix *prefix, char *text, size_t length, int ends_line) {
+    if(output->iov_count + OUTPUT_IOVECS_PER_LINE > OUTPUT_IOV_COUNT || output->used + length * SCRUB_EXPANSION > OUTPUT_BATCH_SIZE) {
+        flush_output(output);
+    }
+
+    if(prefix != NULL) {
+#ifdef SUPERVISOR_BENCHMARK
+        bench_record_line(output, text, length);
+#endif
+        if(TIMESTAMP_FORMAT != TIMESTAMP_NONE) {
+            queue_iovec(output, &line_clock.text[0], line_clock.length);
+        }
+
+        queue_iovec(output, prefix->text, prefix->length);
+    }
+
+    if(length * SCRUB_EXPANSION > OUTPUT_BATCH_SIZE) {
+        if(SCRUB_ESCAPES) {
+            queue_in_pieces(output, text, length);
+        } else {
+            queue_iovec(output, text, copy_scrubbed(text, text, length));
+        }
+
+        if(ends_line) {
+            queue_iovec(output, LINE_END, LINE_END_LENGTH);
+        }
+
+        flush_output(output);
+        return;
+    }
+
+    size_t scrubbed = copy_scrubbed(&output->data[output->used], text, length);
+
+    queue_iovec(output, &output->data[output->used], scrubbed);
+    output->used += scrubbed;
+
+    if(ends_line) {
+        queue_iovec(output, LINE_END, LINE_END_LENGTH);
+    }
+
+    if(OUTPUT_FLUSH_POLICY == OUTPUT_FLUSH_PER_LINE) {
+        flush_output(output);
+    }
+}
+
+void queue_line(struct output *output, const struct line_prefix *prefix, char *line, size_t length) {
+    queue_text(output, prefix, line, length, 1);
+}
+
+// formats the prefix for lines from the given source once, with its name
+// escaped as messages are
+void build_prefix(struct line_prefix *prefix, const char *name, const char *stream) {
+    size_t name_length = strlen(name);
+    char escaped[name_length * SCRUB_EXPANSION + 1];
+
+    escaped[copy_scrubbed(&escaped[0], name, name_length)] = '\0';
+
+    size_t size = sizeof(escaped) + 64;
+    char *text = malloc(size);
+
+    if(text == NULL) {
+        err(1, "malloc");
+    }
+
+    // the object is opened by the timestamp when there is one
+    if(OUTPUT_FORMAT == OUTPUT_FORMAT_JSON) {
+        prefix->length = snprintf(text, size, "%s\"src\":\"%s\",\"stream\":\"%s\",\"msg\":\"", TIMESTAMP_FORMAT == TIMESTAMP_NONE ? "{" : "", &escaped[0], stream);
+    } else if(OUTPUT_FORMAT == OUTPUT_FORMAT_LOGFMT) {
+        const char *quote = escaped[strcspn(&escaped[0], " =\"\\")] != '\0' ? "\"" : "";
+
+        prefix->length = snprintf(text, size, "src=%s%s%s stream=%s msg=\"", quote, &escaped[0], quote, stream);
+    } else {
+        prefix->length = snprintf(text, size, "[%s] ", name);
+    }
+
+    prefix->text = text;
+}
+
+void setup_prefixes() {
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        build_prefix(&children[i].out_buffer.prefix, children[i].name, "out");
+        build_prefix(&children[i].err_buffer.prefix, children[i].name, "err");
+        build_prefix(&children[i].ring_buffer.prefix, children[i].name, "out");
+    }
+
+    build_prefix(&system_prefix, "SYSTEM", "out");
+    build_prefix(&stats_prefix, "STATS", STATS_FD == STDOUT_FILENO ? "out" : "err");
+}
+
+// queues a line of the supervisor's own, in order with the output of children
+void system_message(const char *format, ...) {
+    char text[512];
+    va_list arguments;
+
+    va_start(arguments, format);
+    int length = vsnprintf(&text[0], sizeof(text), format, arguments);
+    va_end(arguments);
+
+    if(length < 0) {
+        return;
+    }
+
+    if((size_t)length >= sizeof(text)) {
+        length = sizeof(text) - 1;
+    }
+
+    queue_line(&output_stdout, &system_prefix, &text[0], length);
+}
+
+void stats_line(const char *format, ...) {
+    char text[512];
+    va_list arguments;
+
+    va_start(arguments, format);
+    int length = vsnprintf(&text[0], sizeof(text), format, arguments);
+    va_end(arguments);
+
+    if(length < 0) {
+        return;
+    }
+
+    if((size_t)length >= sizeof(text)) {
+        length = sizeof(text) - 1;
+    }
+
+    if(STATS_FD == STDOUT_FILENO || STATS_FD == STDERR_FILENO) {
+        queue_line(STATS_FD == STDOUT_FILENO ? &output_stdout : &output_stderr, &stats_prefix, &text[0], length);
+        return;
+    }
+
+    char scrubbed[sizeof(text) * SCRUB_EXPANSION];
+    struct iovec iov[4] = {
+        { .iov_base = &line_clock.text[0], .iov_len = TIMESTAMP_FORMAT == TIMESTAMP_NONE ? 0 : line_clock.length },
+        { .iov_base = (char *)stats_prefix.text, .iov_len = stats_prefix.length },
+        { .iov_base = &scrubbed[0], .iov_len = copy_scrubbed(&scrubbed[0], &text[0], length) },
+        { .iov_base = LINE_END, .iov_len = LINE_END_LENGTH }
+    };
+
+    // a descriptor of its own is expected to keep up, so this may block
+    while(writev(STATS_FD, &iov[0], 4) == -1 && errno == EINTR) {}
+}
+
+void stream_stats_fields(char *text, size_t size, const char *stream, const struct stream_stats *stats) {
+    snprintf(text, size, "%s_bytes=%llu %s_lines=%llu %s_long_lines=%llu %s_reads=%llu %s_rate_limited=%llu",
+        stream, stats->bytes, stream, stats->lines, stream, stats->long_lines, stream, stats->reads, stream, stats->rate_limited);
+}
+
+// one line per child and a few global ones, in key=value form; with
+// IO_WORKERS the stream counters are read while workers update them, which
+// at worst shows a count a moment out of date
+void write_stats() {
+    char out[200];
+    char err[200];
+    char ring[201];
+    char status[32];
+
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        const struct child_state *child = &children[i];
+
+        stream_stats_fields(&out[0], sizeof(out), "out", &child->out_buffer.stats);
+        stream_stats_fields(&err[0], sizeof(err), "err", &child->err_buffer.stats);
+
+        // with a leading space, so that children without a ring leave no gap
+        ring[0] = '\0';
+
+        if(child->config->log_ring) {
+            ring[0] = ' ';
+            stream_stats_fields(&ring[1], sizeof(ring) - 1, "ring", &child->ring_buffer.stats);
+        }
+
+        if(!child->has_exited) {
+            snprintf(&status[0], sizeof(status), "none");
+        } else if(WIFSIGNALED(child->exit_status)) {
+            snprintf(&status[0], sizeof(status), "signal:%i", WTERMSIG(child->exit_status));
+        } else {
+            snprintf(&status[0], sizeof(status), "exit:%i", WEXITSTATUS(child->exit_status));
+        }
+
+        stats_line("child=%s pid=%lli running=%i restarts=%llu last_status=%s wakeups=%llu %s %s%s",
+            child->name, (long long int)(child->running ? child->pid : 0), child->running,
+            child->restarts, &status[0], child->wakeups, &out[0], &err[0], &ring[0]);
+    }
+
+    stats_line("loop iterations=%llu wakeups=%llu busy_p50_ns=%llu busy_p99_ns=%llu busy_max_ns=%llu timer_late_p99_ns=%llu timer_late_max_ns=%llu",
+        loop_iterations, loop_wakeups,
+        (unsigned long long)histogram_percentile(&loop_busy, 50), (unsigned long long)histogram_percentile(&loop_busy, 99), (unsigned long long)loop_busy.max,
+        (unsigned long long)histogram_percentile(&timer_lateness, 99), (unsigned long long)timer_lateness.max);
+
+    stats_line("output fd=%i queued=%zu lines_dropped=%llu", output_stdout.fd, output_queued(&output_stdout), output_stdout.lines_dropped);
+    stats_line("output fd=%i queued=%zu lines_dropped=%llu", output_stderr.fd, output_queued(&output_stderr), output_stderr.lines_dropped);
+
+    for(int i = 0; i < log_file_count; i += 1) {
+        stats_line("log_file path=%s size=%llu buffered=%zu lines_dropped=%llu", log_files[i].path,
+            (unsigned long long)log_files[i].size, log_files[i].used, log_files[i].output->lines_dropped);
+    }
+}
+
+struct timer rate_limit_timer;
+
+// says how many lines each child has had dropped since the last time
+void report_rate_limits() {
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        struct child_state *child = &children[i];
+        unsigned long long dropped = child->out_buffer.stats.rate_limited + child->err_buffer.stats.rate_limited + child->ring_buffer.stats.rate_limited;
+
+        if(dropped > child->rate.reported) {
+            system_message("%s: dropped %llu lines over its rate limit.", child->name, dropped - child->rate.reported);
+            child->rate.reported = dropped;
+        }
+    }
+}
+
+void rate_limit_report_expired(struct timer *timer) {
+    report_rate_limits();
+    timer_set(timer, RATE_LIMIT_REPORT_INTERVAL);
+}
+
+// the rendered metrics, kept until the counters change
+struct metrics_render {
+    char *text;
+    size_t length;
+    size_t capacity;
+    unsigned long long generation;
+    int valid;
+};
+
+struct metrics_render metrics_render;
+
+void metrics_append(const char *format, ...) {
+    va_list arguments;
+
+    while(1) {
+        size_t space = metrics_render.capacity - metrics_render.length;
+
+        va_start(arguments, format);
+        int length = vsnprintf(metrics_render.text + metrics_render.length, space, format, arguments);
+        va_end(arguments);
+
+        if(length < 0) {
+            return;
+        }
+
+        if((size_t)length < space) {
+            metrics_render.length += length;
+            return;
+        }
+
+        size_t capacity = metrics_render.capacity ? metrics_render.capacity * 2 : 16384;
+        char *text = realloc(metrics_render.text, capacity);
+
+        if(text == NULL) {
+            warnx("out of memory rendering metrics");
+            return;
+        }
+
+        metrics_render.text = text;
+        metrics_render.capacity = capacity;
+    }
+}
+
+// writes a child name as a label value, escaped as the exposition format requires
+void metrics_append_label(const char *value) {
+    for(; *value != '\0'; value += 1) {
+        if(*value == '\\' || *value == '"') {
+            metrics_append("\\%c", *value);
+        } else if(*value == '\n') {
+            metrics_append("\\n");
+        } else {
+            metrics_append("%c", *value);
+        }
+    }
+}
+
+void metrics_append_child(const char *metric, const struct child_state *child, const char *stream, unsigned long long value) {
+    metrics_append("%s{child=\"", metric);
+    metrics_append_label(child->name);
+
+    if(stream != NULL) {
+        metrics_append("\",stream=\"%s", stream);
+    }
+
+    metrics_append("\"} %llu\n", value);
+}
+
+void metrics_append_stream_counter(const char *metric, const char *help, size_t offset) {
+    metrics_append("# HELP %s %s\n# TYPE %s counter\n", metric, help, metric);
+
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        const struct child_state *child = &children[i];
+
+        metrics_append_child(metric, child, "stdout", *(const unsigned long long *)((const char *)&child->out_buffer.stats + offset));
+        metrics_append_child(metric, child, "stderr", *(const unsigned long long *)((const char *)&child->err_buffer.stats + offset));
+
+        if(child->config->log_ring) {
+            metrics_append_child(metric, child, "ring", *(const unsigned long long *)((const char *)&child->ring_buffer.stats + offset));
+        }
+    }
+}
+
+void metrics_append_summary(const char *metric, const char *help, const struct histogram *histogram) {
+    static const double quantiles[] = { 50, 90, 99 };
+
+    metrics_append("# HELP %s %s\n# TYPE %s summary\n", metric, help, metric);
+
+    for(int i = 0; i < 3; i += 1) {
+        metrics_append("%s{quantile=\"%g\"} %.9f\n", metric, quantiles[i] / 100, histogram_percentile(histogram, quantiles[i]) / 1e9);
+    }
+
+    metrics_append("%s_sum %.9f\n%s_count %llu\n", metric, histogram->sum / 1e9, metric, (unsigned long long)histogram->count);
+}
+
+// renders the counters in the Prometheus text exposition format
+void render_metrics() {
+    metrics_render.length = 0;
+
+    metrics_append_stream_counter("supervisor_child_read_bytes_total", "Bytes read from the child.", offsetof(struct stream_stats, bytes));
+    metrics_append_stream_counter("supervisor_child_lines_total", "Lines read from the child.", offsetof(struct stream_stats, lines));
+    metrics_append_stream_counter("supervisor_child_long_lines_total", "Lines longer than MAX_LINE_LENGTH.", offsetof(struct stream_stats, long_lines));
+    metrics_append_stream_counter("supervisor_child_reads_total", "Read or splice calls on the child's pipes, and takes from its log ring.", offsetof(struct stream_stats, reads));
+    metrics_append_stream_counter("supervisor_child_rate_limited_lines_total", "Lines dropped for being over the child's rate limit.", offsetof(struct stream_stats, rate_limited));
+
+    metrics_append("# HELP supervisor_child_wakeups_total Event loop wakeups for the child.\n# TYPE supervisor_child_wakeups_total counter\n");
+
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        metrics_append_child("supervisor_child_wakeups_total", &children[i], NULL, children[i].wakeups);
+    }
+
+    metrics_append("# HELP supervisor_child_restarts_total Restarts scheduled for the child.\n# TYPE supervisor_child_restarts_total counter\n");
+
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        metrics_append_child("supervisor_child_restarts_total", &children[i], NULL, children[i].restarts);
+    }
+
+    metrics_append("# HELP supervisor_child_running Whether the child is running.\n# TYPE supervisor_child_running gauge\n");
+
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        metrics_append_child("supervisor_child_running", &children[i], NULL, children[i].running);
+    }
+
+    metrics_append("# HELP supervisor_loop_iterations_total Event loop iterations.\n# TYPE supervisor_loop_iterations_total counter\nsupervisor_loop_iterations_total %llu\n", loop_iterations);
+    metrics_append("# HELP supervisor_loop_wakeups_total Event loop iterations with ready descriptors.\n# TYPE supervisor_loop_wakeups_total counter\nsupervisor_loop_wakeups_total %llu\n", loop_wakeups);
+    metrics_append_summary("supervisor_loop_busy_seconds", "Time spent handling each wakeup.", &loop_busy);
+    metrics_append_summary("supervisor_timer_lateness_seconds", "How late timers expire.", &timer_lateness);
+
+    metrics_append("# HELP supervisor_output_queued_bytes Output waiting for the destination.\n# TYPE supervisor_output_queued_bytes gauge\n");
+    metrics_append("supervisor_output_queued_bytes{fd=\"%i\"} %zu\n", output_stdout.fd, output_queued(&output_stdout));
+    metrics_append("supervisor_output_queued_bytes{fd=\"%i\"} %zu\n", output_stderr.fd, output_queued(&output_stderr));
+    metrics_append("# HELP supervisor_output_dropped_lines_total Lines dropped by OUTPUT_OVERFLOW_POLICY.\n# TYPE supervisor_output_dropped_lines_total counter\n");
+    metrics_append("supervisor_output_dropped_lines_total{fd=\"%i\"} %llu\n", output_stdout.fd, output_stdout.lines_dropped);
+    metrics_append("supervisor_output_dropped_lines_total{fd=\"%i\"} %llu\n", output_stderr.fd, output_stderr.lines_dropped);
+
+    if(log_file_count > 0) {
+        metrics_append("# HELP supervisor_log_file_dropped_lines_total Lines a log file could not be written.\n# TYPE supervisor_log_file_dropped_lines_total counter\n");
+    }
+
+    for(int i = 0; i < log_file_count; i += 1) {
+        metrics_append("supervisor_log_file_dropped_lines_total{path=\"");
+        metrics_append_label(log_files[i].path);
+        metrics_append("\"} %llu\n", log_files[i].output->lines_dropped);
+    }
+
+    metrics_render.generation = stats_generation;
+    metrics_render.valid = 1;
+}
+
+// seconds a scrape may take before its connection is dropped
+#define METRICS_CONNECTION_TIMEOUT 5
+
+struct metrics_connection {
+    struct event_source source;
+    struct timer timeout;
+    // the end of the request headers is searched for in here
+    char request[1024];
+    size_t received;
+    char header[128];
+    size_t header_length;
+    // bytes of the header and then the render written so far, or -1 while
+    // the request is being read
+    ssize_t sent;
+};
+
+struct metrics_connection metrics_connections[METRICS_CONNECTION_COUNT];
+int metrics_connections_open;
+
+struct event_source metrics_listener = { .fd = -1, .flavour = FLAVOUR_METRICS_LISTENER, .events = EVENT_READ, .index = -1 };
+
+void open_metrics_socket() {
+    struct sockaddr_un address;
+
+    bzero(&address, sizeof(address));
+    address.sun_family = AF_UNIX;
+
+    if(strlen(METRICS_SOCKET_PATH) >= sizeof(address.sun_path)) {
+        errx(1, "metrics socket path %s is too long", METRICS_SOCKET_PATH);
+    }
+
+    strcpy(&address.sun_path[0], METRICS_SOCKET_PATH);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(fd == -1) {
+        err(1, "socket()");
+    }
+
+    // left behind by an earlier run; there is no point removing it on exit,
+    // as a supervisor that is killed leaves it anyway
+    if(unlink(METRICS_SOCKET_PATH) == -1 && errno != ENOENT) {
+        err(1, "unlink(%s)", METRICS_SOCKET_PATH);
+    }
+
+    if(bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        err(1, "bind(%s)", METRICS_SOCKET_PATH);
+    }
+
+    if(listen(fd, 16) == -1) {
+        err(1, "listen()");
+    }
+
+    if(fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        err(1, "fcntl(..., F_SETFD, FD_CLOEXEC)");
+    }
+
+    if(fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+        err(1, "fcntl(..., F_SETFL, O_NONBLOCK)");
+    }
+
+    metrics_listener.fd = fd;
+
+    for(int i = 0; i < METRICS_CONNECTION_COUNT; i += 1) {
+        metrics_connections[i].source = (struct event_source){ .fd = -1, .flavour = FLAVOUR_METRICS_CONNECTION, .index = -1, .object = &metrics_connections[i] };
+    }
+}
+
+void close_metrics_connection(struct metrics_connection *connection) {
+    event_remove_source(&connection->source);
+    timer_cancel(&connection->timeout);
+    close(connection->source.fd);
+    connection->source.fd = -1;
+
+    // with every slot taken the listener was left alone, so take it back
+    if(metrics_connections_open == METRICS_CONNECTION_COUNT) {
+        event_add(&metrics_listener);
+    }
+
+    metrics_connections_open -= 1;
+}
+
+void metrics_connection_timed_out(struct timer *timer) {
+    close_metrics_connection(timer->object);
+}
+
+void accept_metrics_connections() {
+    while(metrics_connections_open < METRICS_CONNECTION_COUNT) {
+        int fd = accept(metrics_listener.fd, NULL, NULL);
+
+        if(fd == -1) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                warn("accept()");
+            }
+            return;
+        }
+
+        if(fcntl(fd, F_SETFD, FD_CLOEXEC) == -1 || fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+            warn("fcntl() on a metrics connection");
+            close(fd);
+            continue;
+        }
+
+#ifdef SO_NOSIGPIPE
+        int one = 1;
+
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+
+        struct metrics_connection *connection = &metrics_connections[0];
+
+        while(connection->source.fd != -1) {
+            connection += 1;
+        }
+
+        connection->source.fd = fd;
+        connection->source.events = EVENT_READ;
+        connection->received = 0;
+        connection->sent = -1;
+        connection->timeout.expire = metrics_connection_timed_out;
+        connection->timeout.object = connection;
+
+        if(event_add(&connection->source) == -1) {
+            close(fd);
+            connection->source.fd = -1;
+            continue;
+        }
+
+        timer_set(&connection->timeout, (uint64_t)METRICS_CONNECTION_TIMEOUT * 1000);
+        metrics_connections_open += 1;
+    }
+
+    // leave further connections in the backlog until a slot is free
+    event_remove_source(&metrics_listener);
+}
+
+// returns 1 once the request has been read, whatever it asked for
+int read_metrics_request(struct metrics_connection *connection) {
+    while(1) {
+        size_t space = sizeof(connection->request) - connection->received;
+        ssize_t bytes_read = read(connection->source.fd, &connection->request[connection->received], space);
+
+        if(bytes_read == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        if(bytes_read == 0) {
+            return 1;
+        }
+
+        size_t start = connection->received < 3 ? 0 : connection->received - 3;
+
+        connection->received += bytes_read;
+
+        for(size_t i = start; i + 1 < connection->received; i += 1) {
+            if(connection->request[i] != '\n') {
+                continue;
+            }
+
+            if(connection->request[i + 1] == '\n' || (i + 2 < connection->received && connection->request[i + 1] == '\r' && connection->request[i + 2] == '\n')) {
+                return 1;
+            }
+        }
+
+        // only the headers matter, so a request this long is served as is
+        if(connection->received == sizeof(connection->request)) {
+            return 1;
+        }
+    }
+}
+
+void serve_metrics_connection(struct metrics_connection *connection) {
+    if(connection->sent == -1) {
+        int rv = read_metrics_request(connection);
+
+        if(rv == 0) {
+            return;
+        }
+
+        if(rv == -1) {
+            close_metrics_connection(connection);
+            return;
+        }
+
+        // a render still being sent elsewhere is served again rather than changed
+        int sending = 0;
+
+        for(int i = 0; i < METRICS_CONNECTION_COUNT; i += 1) {
+            sending |= metrics_connections[i].source.fd != -1 && metrics_connections[i].sent >= 0;
+        }
+
+        if(!metrics_render.valid || (metrics_render.generation != stats_generation && !sending)) {
+            render_metrics();
+        }
+
+        connection->header_length = snprintf(&connection->header[0], sizeof(connection->header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", metrics_render.length);
+        connection->sent = 0;
+
+        event_remove_source(&connection->source);
+        connection->source.events = EVENT_WRITE;
+
+        if(event_add(&connection->source) == -1) {
+            close_metrics_connection(connection);
+            return;
+        }
+    }
+
+    while((size_t)connection->sent < connection->header_length + metrics_render.length) {
+        struct iovec iov[2];
+        int iov_count = 0;
+        size_t sent = connection->sent;
+
+        if(sent < connection->header_length) {
+            iov[iov_count] = (struct iovec){ .iov_base = &connection->header[sent], .iov_len = connection->header_length - sent };
+            iov_count += 1;
+            sent = connection->header_length;
+        }
+
+        iov[iov_count] = (struct iovec){ .iov_base = metrics_render.text + (sent - connection->header_length), .iov_len = metrics_render.length - (sent - connection->header_length) };
+        iov_count += 1;
+
+        struct msghdr message = { .msg_iov = &iov[0], .msg_iovlen = iov_count };
+        ssize_t bytes_written = sendmsg(connection->source.fd, &message, MSG_NOSIGNAL);
+
+        if(bytes_written == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+
+            break;
+        }
+
+        connection->sent += bytes_written;
+    }
+
+    close_metrics_connection(connection);
+}
+
+// bytes a line may hold, not counting its line feed
+#define LINE_CAPACITY (MAX_LINE_LENGTH - 1)
+
+int rate_limited(const struct child_configuration *config) {
+    return config->rate_limit.lines_per_second > 0 || config->rate_limit.bytes_per_second > 0;
+}
+
+void refill_rate_limit(struct child_state *child) {
+    const struct rate_limit_configuration *config = &child->config->rate_limit;
+    struct rate_limit_state *rate = &child->rate;
+    uint64_t now = monotonic_ns();
+    double elapsed = (now - rate->refilled_at) / 1e9;
+    double lines = config->lines_per_second * (RATE_LIMIT_BURST / 1000.0);
+    double bytes = config->bytes_per_second * (RATE_LIMIT_BURST / 1000.0);
+
+    rate->refilled_at = now;
+    rate->lines += elapsed * config->lines_per_second;
+    rate->bytes += elapsed * config->bytes_per_second;
+
+    if(rate->lines > lines) {
+        rate->lines = lines;
+    }
+
+    if(rate->bytes > bytes) {
+        rate->bytes = bytes;
+    }
+}
+
+// decides on a line before anything else is done with it, returning 0 for
+// one to drop
+int admit_line(struct buffer *buffer, size_t length) {
+    struct child_state *child = buffer->source.object;
+    const struct rate_limit_configuration *config = &child->config->rate_limit;
+    struct rate_limit_state *rate = &child->rate;
+
+    if(!rate_limited(child->config)) {
+        return 1;
+    }
+
+    if((config->lines_per_second == 0 || rate->lines > 0) && (config->bytes_per_second == 0 || rate->bytes > 0)) {
+        rate->lines -= 1;
+        rate->bytes -= length;
+        return 1;
+    }
+
+    rate->over += 1;
+
+    if(config->sample > 0 && rate->over % config->sample == 0) {
+        return 1;
+    }
+
+    buffer->stats.rate_limited += 1;
+    return 0;
+}
+
+void count_long_line(struct buffer *buffer) {
+    if(!buffer->long_line) {
+        buffer->long_line = 1;
+        buffer->stats.long_lines += 1;
+    }
+}
+
+void finish_line(struct buffer *buffer, const struct line_prefix *prefix, char *line, size_t length) {
+    if(length > 0 && line[length - 1] == '\r') {
+        length -= 1;
+    }
+
+    buffer->stats.lines += 1;
+
+    if(length > LINE_CAPACITY) {
+        count_long_line(buffer);
+    }
+
+    buffer->long_line = 0;
+
+    if(buffer->overflow) {
+        // the start of this line has already been dealt with
+        buffer->overflow = 0;
+
+        if(buffer->dropping) {
+            buffer->dropping = 0;
+        } else if(LONG_LINE_POLICY == LONG_LINE_PASSTHROUGH) {
+            queue_text(buffer->destination, NULL, line, length, 1);
+            release_output(buffer->destination);
+        }
+
+        return;
+    }
+
+    if(!admit_line(buffer, length)) {
+        return;
+    }
+
+    if(LONG_LINE_POLICY == LONG_LINE_TRUNCATE && length > LINE_CAPACITY) {
+        length = LINE_CAPACITY;
+    }
+
+    while(LONG_LINE_POLICY == LONG_LINE_SPLIT && length > LINE_CAPACITY) {
+        queue_line(buffer->destination, prefix, line, LINE_CAPACITY);
+        line += LINE_CAPACITY;
+        length -= LINE_CAPACITY;
+    }
+
+    queue_line(buffer->destination, prefix, line, length);
+}
+
+// deals with whatever part of an incomplete line cannot wait for its line
+// feed, returning where the part to keep begins
+char *overflow_line(struct buffer *buffer, const struct line_prefix *prefix, char *line, char *end) {
+    if(buffer->overflow) {
+        if(LONG_LINE_POLICY == LONG_LINE_PASSTHROUGH && !buffer->dropping) {
+            queue_text(buffer->destination, NULL, line, end - line, 0);
+        }
+        return end;
+    }
+
+    if((size_t)(end - line) <= LINE_CAPACITY) {
+        return line;
+    }
+
+    count_long_line(buffer);
+
+    // the rest of the line goes the same way once it comes
+    if(!admit_line(buffer, end - line)) {
+        buffer->overflow = 1;
+        buffer->dropping = 1;
+        return end;
+    }
+
+    if(LONG_LINE_POLICY == LONG_LINE_SPLIT) {
+        while((size_t)(end - line) > LINE_CAPACITY) {
+            queue_line(buffer->destination, prefix, line, LINE_CAPACITY);
+            line += LINE_CAPACITY;
+        }
+        return line;
+    }
+
+    buffer->overflow = 1;
+
+    if(LONG_LINE_POLICY == LONG_LINE_TRUNCATE) {
+        queue_line(buffer->destination, prefix, line, LINE_CAPACITY);
+    } else {
+        // nothing else may be written to the destination until this line ends
+        buffer->destination->owner = buffer;
+        queue_text(buffer->destination, prefix, line, end - line, 0);
+    }
+
+    return end;
+}
+
+void flush_buffer(struct buffer *buffer, const struct line_prefix *prefix) {
+    if(buffer->position > 0 || buffer->overflow) {
+        finish_line(buffer, prefix, buffer->buffer, buffer->position);
+    }
+
+    buffer->position = 0;
+}
+
+void split_lines(struct buffer *buffer, const struct line_prefix *prefix, size_t length) {
+    char *line = buffer->buffer;
+    char *scan = line + buffer->position;
+    char *end = scan + length;
+    char *newline;
+    struct child_state *child = buffer->source.object;
+
+    if(rate_limited(child->config)) {
+        refill_rate_limit(child);
+    }
+
+    // the incomplete line kept from the last read is known to hold no line feed
+    while((newline = memchr(scan, '\n', end - scan)) != NULL) {
+        finish_line(buffer, prefix, line, newline - line);
+        line = newline + 1;
+        scan = line;
+    }
+
+    line = overflow_line(buffer, prefix, line, end);
+
+    // keep the incomplete line at the front for the next read
+    buffer->position = end - line;
+    memmove(buffer->buffer, line, buffer->position);
+}
+
+int pump_buffer(struct buffer *buffer, const struct line_prefix *prefix) {
+    for(int reads = 0; reads < STREAM_READS_PER_WAKEUP; reads += 1) {
+        // an incomplete line taking up more than half the buffer leaves too
+        // little room for the next read
+        if(buffer->buffer == NULL || (buffer->position > buffer->capacity / 2 && buffer->capacity < STREAM_BUFFER_LIMIT)) {
+            if(resize_buffer(buffer, buffer->capacity * 2) == -1) {
+                struct child_state *child = buffer->source.object;
+
+                warnx("out of memory buffering output of %s", child->name);
+                return -1;
+            }
+        }
+
+        size_t buffer_space_left = buffer->capacity - buffer->position;
+        ssize_t bytes_read = read(buffer->source.fd, buffer->buffer + buffer->position, buffer_space_left);
+
+        buffer->stats.reads += 1;
+
+        if(bytes_read == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+
+            return -1;
+        }
+
+        if(bytes_read == 0) {
+            flush_buffer(buffer, prefix);
+            return 0;
+        }
+
+        buffer->stats.bytes += bytes_read;
+        split_lines(buffer, prefix, bytes_read);
+
+        // a short read means the pipe has been emptied
+        if((size_t)bytes_read < buffer_space_left || buffer->destination->congested) {
+            break;
+        }
+
+        // while reads keep filling the buffer, let them grow; failing to is harmless
+        if(buffer->capacity < STREAM_BUFFER_SIZE) {
+            resize_buffer(buffer, buffer->capacity * 2);
+        }
+    }
+
+    return 1;
+}
+
+#ifdef __linux__
+// returns -1 when the caller should fall back to copying through userspace
+int splice_buffer(struct buffer *buffer) {
+    for(int moves = 0; moves < STREAM_READS_PER_WAKEUP; moves += 1) {
+        ssize_t bytes_moved = splice(buffer->source.fd, NULL, buffer->destination->fd, NULL, STREAM_BUFFER_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        buffer->stats.reads += 1;
+
+        if(bytes_moved == 0) {
+            return 0;
+        }
+
+        if(bytes_moved > 0) {
+            buffer->stats.bytes += bytes_moved;
+            continue;
+        }
+
+        if(errno == EINTR) {
+            continue;
+        }
+
+        if(errno == EAGAIN) {
+            int pending;
+
+            // either the pipe is empty, or the destination is full and
+            // the data has to be queued like any other output
+            if(ioctl(buffer->source.fd, FIONREAD, &pending) == -1 || pending > 0) {
+                return -1;
+            }
+
+            return 1;
+        }
+
+        // typically a destination, such as a terminal, that cannot be spliced to
+        buffer->destination->splice_usable = 0;
+        return -1;
+    }
+
+    return 1;
+}
+#endif
+
+int pump_passthrough(struct buffer *buffer) {
+    // anything already staged or queued for this destination has to go out first
+    flush_output(buffer->destination);
+
+#ifdef __linux__
+    if(buffer->destination->splice_usable && output_queued(buffer->destination) == 0) {
+        int rv = splice_buffer(buffer);
+
+        if(rv != -1) {
+            return rv;
+        }
+    }
+#endif
+
+    if(buffer->buffer == NULL && resize_buffer(buffer, STREAM_BUFFER_SIZE) == -1) {
+        warnx("out of memory buffering output");
+        return -1;
+    }
+
+    for(int reads = 0; reads < STREAM_READS_PER_WAKEUP; reads += 1) {
+        ssize_t bytes_read = read(buffer->source.fd, buffer->buffer, buffer->capacity);
+
+        buffer->stats.reads += 1;
+
+        if(bytes_read == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+
+            return -1;
+        }
+
+        if(bytes_read == 0) {
+            return 0;
+        }
+
+        buffer->stats.bytes += bytes_read;
+        queue_iovec(buffer->destination, buffer->buffer, bytes_read);
+        flush_output(buffer->destination);
+
+        if((size_t)bytes_read < buffer->capacity || buffer->destination->congested) {
+            break;
+        }
+    }
+
+    return 1;
+}
+
+// copies what the child has written to its log ring into the buffer, where
+// it is split into lines as if it had been read from a pipe; the doorbell
+// only says there may be something to take
+int pump_ring(struct child_state *child, struct buffer *buffer) {
+    struct log_ring *ring = child->ring;
+    char dummy[64];
+
+    while(read(buffer->source.fd, &dummy[0], sizeof(dummy)) > 0) {}
+
+    for(int reads = 0; reads < STREAM_READS_PER_WAKEUP; reads += 1) {
+        uint64_t available = atomic_load_explicit(&ring->tail, memory_order_acquire) - child->ring_head;
+
+        if(available == 0) {
+            // from here on the child rings for what it writes
+            atomic_store(&ring->waiting, 1);
+
+            if(atomic_load(&ring->tail) == child->ring_head) {
+                return 1;
+            }
+
+            continue;
+        }
+
+        if(available > LOG_RING_SIZE) {
+            warnx("%s has corrupted its log ring", child->name);
+            return -1;
+        }
+
+        if(buffer->buffer == NULL || (buffer->position > buffer->capacity / 2 && buffer->capacity < STREAM_BUFFER_LIMIT)) {
+            if(resize_buffer(buffer, buffer->buffer == NULL ? STREAM_BUFFER_SIZE : buffer->capacity * 2) == -1) {
+                warnx("out of memory buffering output of %s", child->name);
+                return -1;
+            }
+        }
+
+        size_t space = buffer->capacity - buffer->position;
+        size_t length = available < space ? available : space;
+        size_t start = child->ring_head & (LOG_RING_SIZE - 1);
+        size_t first = length < LOG_RING_SIZE - start ? length : LOG_RING_SIZE - start;
+
+        memcpy(buffer->buffer + buffer->position, &ring->data[start], first);
+        memcpy(buffer->buffer + buffer->position + first, &ring->data[0], length - first);
+        child->ring_head += length;
+        atomic_store_explicit(&ring->head, child->ring_head, memory_order_release);
+
+        buffer->stats.reads += 1;
+        buffer->stats.bytes += length;
+        split_lines(buffer, &buffer->prefix, length);
+
+        if(buffer->destination->congested) {
+            break;
+        }
+    }
+
+    // the child will not ring for what is left, so the supervisor does
+    write(child->ring_doorbell, "x", 1);
+
+    return 1;
+}
+
+// returns 0 once the stream has been closed by the child, -1 on errors
+int pump_stream(struct child_state *child, struct buffer *buffer) {
+    if(buffer->source.fd == -1 || buffer->paused) {
+        return 1;
+    }
+
+    if(buffer->source.flavour == FLAVOUR_RING) {
+        return pump_ring(child, buffer);
+    }
+
+    if(child->config->passthrough) {
+        return pump_passthrough(buffer);
+    }
+
+    return pump_buffer(buffer, &buffer->prefix);
+}
+
+void check_signals() {
+    if(stats_requested) {
+        stats_requested = 0;
+        write_stats();
+    }
+
+    if(termination_signal_received) {
+        termination_signal_received = 0;
+        system_message("Received request to terminate.");
+        if(teardown_in_progress) {
+            system_message("Shutdown already in progress, so performing hard shutdown.");
+            brutal_teardown();
+        }
+        system_message("Performing soft shutdown.");
+        teardown();
+    }
+
+    if(reload_requested) {
+        reload_requested = 0;
+        system_message("Received SIGHUP.");
+        begin_reload();
+    }
+
+    if(sigusr1_received) {
+        sigusr1_received = 0;
+
+        system_message("Received SIGUSR1.");
+
+        // unlike the termination signal, these go to the child alone, as what
+        // it has started need not expect them
+        for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+            if(!children[i].running) {
+                continue;
+            }
+            if(children[i].config->receives_sigusr1) {
+                system_message("Passing SIGUSR1 to child %s (%lli).", children[i].name, (long long int)children[i].pid);
+                kill(children[i].pid, SIGUSR1);
+            }
+        }
+    }
+
+    if(sigusr2_received) {
+        sigusr2_received = 0;
+
+        system_message("Received SIGUSR2.");
+
+        for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+            if(!children[i].running) {
+                continue;
+            }
+            if(children[i].config->receives_sigusr2) {
+                system_message("Passing SIGUSR2 to child %s (%lli).", children[i].name, (long long int)children[i].pid);
+                kill(children[i].pid, SIGUSR2);
+            }
+        }
+    }
+}
+
+// starts a child whose backoff has run out
+void restart_child(struct timer *timer) {
+    struct child_state *child = timer->object;
+
+    if(start_child(child) == -1) {
+        system_message("%s could not be restarted.", child->name);
+        teardown();
+    }
+}
+
+// returns 1 if the child is to be started again later, with backoff
+int schedule_restart(struct child_state *child, int status) {
+    const struct child_configuration *config = child->config;
+    uint64_t now = monotonic_ns();
+
+    if(teardown_in_progress || config->restart == RESTART_NEVER) {
+        return 0;
+    }
+
+    if(config->restart == RESTART_ON_FAILURE && status == 0) {
+        return 0;
+    }
+
+    if(now - child->window_started_at > (uint64_t)RESTART_WINDOW * 1000000000ULL) {
+        child->window_started_at = now;
+        child->window_restarts = 0;
+    }
+
+    if(child->window_restarts >= RESTART_MAX_IN_WINDOW) {
+        system_message("%s has been restarted too often.", child->name);
+        return 0;
+    }
+
+    // a child that stayed up for a while starts over from the shortest delay
+    if(now - child->started_at > (uint64_t)RESTART_BACKOFF_MAX * 1000000ULL) {
+        child->backoff_steps = 0;
+    }
+
+    uint64_t delay = RESTART_BACKOFF_INITIAL;
+
+    for(int i = 0; i < child->backoff_steps && delay < RESTART_BACKOFF_MAX; i += 1) {
+        delay *= 2;
+    }
+
+    if(delay > RESTART_BACKOFF_MAX) {
+        delay = RESTART_BACKOFF_MAX;
+    }
+
+    child->backoff_steps += 1;
+    child->window_restarts += 1;
+    child->restarts += 1;
+    child->restart_timer.expire = restart_child;
+    child->restart_timer.object = child;
+    timer_set(&child->restart_timer, delay);
+
+    system_message("Restarting %s in %llu ms.", child->name, (unsigned long long int)delay);
+
+    return 1;
+}
+
+void check_for_terminations() {
+    int check_succeeded = 0;
+
+    while(1) {
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+
+        if(pid < 1) {
+            break;
+        }
+
+        if(pid == sync_helper) {
+            system_message("The sync helper has exited, log files are synced by the supervisor from now on.");
+            sync_helper = -1;
+            close(sync_socket);
+            sync_socket = -1;
+            continue;
+        }
+
+        struct child_state *child = reap(pid, status);
+
+        // orphans of the children are handed to the supervisor as a
+        // subreaper, or as PID 1, and only need reaping
+        if(child == NULL) {
+            continue;
+        }
+
+        if(child->reload == RELOAD_STOPPING && !teardown_in_progress) {
+            restart_for_reload(child);
+            continue;
+        }
+
+        if(schedule_restart(child, status)) {
+            continue;
+        }
+
+        if(!child->config->is_startup_check) {
+            teardown();
+        } else if(status != 0) {
+            if(!teardown_in_progress) {
+                system_message("Startup check failed, shutting down.");
+            }
+            teardown();
+        } else {
+            child->satisfied = 1;
+            check_succeeded = 1;
+            checks_pending -= 1;
+
+            if(checks_pending == 0) {
+                system_message("All startup checks have passed.");
+            }
+        }
+    }
+
+    if(teardown_in_progress) {
+        shutdown_next_wave();
+    }
+
+    if(check_succeeded) {
+        schedule_children();
+    }
+}
+
+int check_pending() {
+    int some_child_running = 0;
+
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        // startup checks that are only a probe keep their timer armed until done
+        if(children[i].running || timer_armed(&children[i].restart_timer) || timer_armed(&children[i].probe.timer)) {
+            some_child_running = 1;
+            break;
+        }
+    }
+
+    return some_child_running;
+}
+
+void handle_stream(struct event_source *source) {
+    struct child_state *child = source->object;
+    struct buffer *buffer = buffer_for_flavour(child, source->flavour);
+
+    child->wakeups += 1;
+
+    if((buffer->destination->owner != NULL && buffer->destination->owner != buffer) || buffer->destination->congested) {
+        pause_buffer(buffer);
+        return;
+    }
+
+    if(pump_stream(child, buffer) < 1) {
+        close_buffer(buffer);
+    }
+}
+
+// returns 1 if anything besides metrics scrapes was handled
+int handle_io() {
+    int busy = 0;
+
+    for(int j = 0; j < event_ready_count; j += 1) {
+        struct event_source *source = event_ready[j];
+
+        if(source->revents == 0) {
+            continue;
+        }
+
+        if(source->flavour == FLAVOUR_METRICS_LISTENER) {
+            accept_metrics_connections();
+            continue;
+        }
+
+        if(source->flavour == FLAVOUR_METRICS_CONNECTION) {
+            serve_metrics_connection(source->object);
+            continue;
+        }
+
+        if(source->flavour == FLAVOUR_PROBE) {
+            handle_probe(source->object);
+            continue;
+        }
+
+        busy = 1;
+
+        if(source->flavour == FLAVOUR_OUTPUT) {
+            drain_queue(source->object);
+            continue;
+        }
+
+        if(source->flavour == FLAVOUR_SIGNAL) {
+            char dummy[1000];
+            read(signal_r, &dummy[0], 1000);
+            continue;
+        }
+
+#if IO_WORKERS > 0
+        if(source->flavour == FLAVOUR_WORKER) {
+            struct worker *worker = source->object;
+            char dummy[64];
+
+            // the rings themselves are drained once per loop iteration
+            read(worker->doorbell_r, &dummy[0], sizeof(dummy));
+            atomic_exchange(&worker->doorbell_rung, 0);
+            continue;
+        }
+#endif
+
+        handle_stream(source);
+    }
+
+    return busy;
+}
+
+#if IO_WORKERS > 0
+// returns the position just past the last line end between head and tail,
+// or head if there is none
+size_t ring_line_end(const struct ring *ring, size_t head, size_t tail) {
+    size_t start = head & (IO_WORKER_RING_SIZE - 1);
+    size_t length = tail - head;
+    size_t first = length < IO_WORKER_RING_SIZE - start ? length : IO_WORKER_RING_SIZE - start;
+    const char *found;
+
+    if(length > first && (found = memrchr(&ring->data[0], '\n', length - first)) != NULL) {
+        return head + first + (found - &ring->data[0]) + 1;
+    }
+
+    if((found = memrchr(&ring->data[start], '\n', first)) != NULL) {
+        return head + (found - &ring->data[start]) + 1;
+    }
+
+    return head;
+}
+
+// moves what a worker sent to a destination onto the destination's output,
+// in whole lines while other workers could be interleaved with it
+void drain_ring(int destination, int index, int everything) {
+    struct worker *worker = &workers[index];
+    struct ring *ring = worker->rings[destination];
+    struct output *output = destinations[destination];
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if(head == tail) {
+        return;
+    }
+
+    if(!everything && (output->congested || (ring_owners[destination] != -1 && ring_owners[destination] != index))) {
+        return;
+    }
+
+    size_t end = tail;
+
+    // part of a line is only passed on by the ring already passing one on,
+    // or when a line too long for half the ring would otherwise block it
+    if(!everything && ring_owners[destination] != index && tail - head < IO_WORKER_RING_SIZE / 2) {
+        end = ring_line_end(ring, head, tail);
+
+        if(end == head) {
+            return;
+        }
+    }
+
+    size_t start = head & (IO_WORKER_RING_SIZE - 1);
+    size_t length = end - head;
+    size_t first = length < IO_WORKER_RING_SIZE - start ? length : IO_WORKER_RING_SIZE - start;
+
+    if(output->iov_count + 2 > OUTPUT_IOV_COUNT) {
+        flush_output(output);
+    }
+
+    queue_iovec(output, &ring->data[start], first);
+
+    if(length > first) {
+        queue_iovec(output, &ring->data[0], length - first);
+    }
+
+    // whatever the destination does not take is copied to its queue
+    flush_output(output);
+
+    ring_owners[destination] = ring->data[(end - 1) & (IO_WORKER_RING_SIZE - 1)] == '\n' ? -1 : index;
+
+    atomic_store(&ring->head, end);
+
+    if(atomic_load(&worker->wants_wake) && atomic_exchange(&worker->wants_wake, 0)) {
+        write(worker->wake_w, "x", 1);
+    }
+}
+
+// with everything set, takes all there is regardless of line boundaries
+void drain_workers(int everything) {
+    for(int i = 0; i < destination_count; i += 1) {
+        // the others wait for a line that has been started to end
+        if(ring_owners[i] != -1) {
+            drain_ring(i, ring_owners[i], everything);
+        }
+
+        for(int j = 0; j < IO_WORKERS; j += 1) {
+            drain_ring(i, j, everything);
+        }
     }
+}
 
-    if(dup2(p_out, STDOUT_FILENO) == -1) {
-        err(1, "dup2() for stdout");
-    }
+// returns 1 once the worker is to stop
+int run_worker_commands(struct worker *worker) {
+    size_t head = atomic_load_explicit(&worker->command_head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&worker->command_tail, memory_order_acquire);
+    int stop = 0;
 
-    if(dup2(p_err, STDERR_FILENO) == -1) {
-        err(1, "dup2() for stderr");
+    for(; head != tail; head += 1) {
+        struct worker_command *command = &worker->commands[head & (WORKER_COMMAND_COUNT - 1)];
+
+        if(command->kind == WORKER_ADD) {
+            if(open_streams(command->child, &command->streams, &worker->outputs[0]) == -1) {
+                warnx("could not read output of %s", command->child->name);
+            }
+        } else if(command->kind == WORKER_CLOSE) {
+            close_streams(command->child);
+        } else {
+            stop = 1;
+        }
     }
 
-    execv(configuration->command[0], &configuration->command[0]);
+    atomic_store_explicit(&worker->command_head, head, memory_order_release);
 
-    err(1, "execve()");
+    return stop;
 }
 
-int setup_children(int phase) {
-    int rv = 0;
+void *run_worker(void *argument) {
+    struct worker *worker = argument;
+    int stop = 0;
 
-    for(int i = 0; i < CHILDREN_COUNT; i += 1) {
-        const struct child_configuration *config = &child_configuration[i];
-        int p_err[2];
-        int p_in[2];
-        int p_out[2];
+    event_init();
 
-        if(phase == PHASE_CHECK && !config->is_startup_check) {
-            continue;
-        }
+    if(event_add(&worker->wake_source) == -1) {
+        errx(1, "could not start I/O worker");
+    }
 
-        if(phase == PHASE_NORMAL && config->is_startup_check) {
-            continue;
-        }
+    while(!stop) {
+        int pending = atomic_load(&worker->command_head) != atomic_load(&worker->command_tail);
+        int ready = event_wait(pending ? 0 : -1);
 
-        children[i].config = config;
+        update_line_clock();
 
-        if(pipe(&p_err[0]) == -1) {
-            warn("pipe()");
-            break;
-        }
+        for(int i = 0; i < ready && i < event_ready_count; i += 1) {
+            struct event_source *source = event_ready[i];
 
-        if(pipe(&p_in[0]) == -1) {
-            warn("pipe()");
-            break;
-        }
+            if(source->revents == 0) {
+                continue;
+            }
 
-        if(pipe(&p_out[0]) == -1) {
-            warn("pipe()");
-            break;
+            if(source->flavour == FLAVOUR_WAKE) {
+                char dummy[64];
+                read(worker->wake_r, &dummy[0], sizeof(dummy));
+                continue;
+            }
+
+            handle_stream(source);
         }
 
-        children[i].err_buffer.source_fd = p_err[0];
-        children[i].err_buffer.destination_fd = STDERR_FILENO;
-        children[i].out_buffer.source_fd = p_out[0];
-        children[i].out_buffer.destination_fd = STDOUT_FILENO;
-        close(p_in[1]);
+        stop = run_worker_commands(worker);
 
-        if(fcntl(p_err[0], F_SETFD, FD_CLOEXEC) == -1) {
-            warn("fcntl(..., F_SETFD, FD_CLOEXEC)");
-            rv = -1;
-            break;
+        for(int i = 0; i < destination_count; i += 1) {
+            flush_output(worker->outputs[i]);
         }
 
-        if(fcntl(p_out[0], F_SETFD, FD_CLOEXEC) == -1) {
-            warn("fcntl(..., F_SETFD, FD_CLOEXEC)");
-            rv = -1;
-            break;
+        if(worker->pushed) {
+            worker->pushed = 0;
+            ring_doorbell(worker);
         }
 
-        pid_t pid = fork();
+        // held back streams read again once the main thread has caught up
+        for(int i = 0; i < destination_count; i += 1) {
+            struct output *output = worker->outputs[i];
+            struct ring *ring = worker->rings[i];
 
-        if(pid == -1) {
-            warn("fork()");
-            rv = -1;
-            break;
-        } else if(pid == 0) {
-            execute(config, p_in[0], p_out[1], p_err[1]);
-        } else {
-            close(p_in[0]);
-            close(p_out[1]);
-            close(p_err[1]);
+            if(!output->congested) {
+                continue;
+            }
+
+            atomic_store(&worker->wants_wake, 1);
 
-            children[i].pid = pid;
-            children[i].running = 1;
-            rv += 1;
+            if(atomic_load(&ring->tail) - atomic_load(&ring->head) <= IO_WORKER_RING_SIZE / 4) {
+                output->congested = 0;
+                resume_output(output);
+            }
         }
     }
 
-    return rv;
-}
-
-void setup_signal_handler() {
-    {
-        int fds[2];
-
-        if(pipe(&fds[0]) == -1) {
-            err(1, "pipe()");
+    for(int i = 0; i < INSTANCES_COUNT; i += 1) {
+        if(worker_for(&children[i]) == worker) {
+            close_streams(&children[i]);
         }
+    }
 
-        signal_r = fds[0];
-        signal_w = fds[1];
-
-        if(fcntl(signal_w, F_SETFL, O_NONBLOCK) == -1) {
-            err(1, "fcntl(%i, F_SETFL, O_NONBLOCK)", signal_w);
-        }
+    for(int i = 0; i < destination_count; i += 1) {
+        flush_output(worker->outputs[i]);
     }
 
-    struct sigaction sig;
+#ifdef SUPERVISOR_BENCHMARK
+    worker->bench_lines = bench_lines;
+    worker->bench_latency = bench_latency;
+#endif
 
-    bzero(&sig, sizeof(struct sigaction));
+    atomic_store(&worker->finished, 1);
+    atomic_exchange(&worker->doorbell_rung, 1);
+    write(worker->doorbell_w, "x", 1);
 
-    sig.sa_handler = signal_handler;
+    return NULL;
+}
 
-    if(sigemptyset(&sig.sa_mask) == -1) {
-        errx(1, "could not clear signal mask");
-    }
+void setup_worker_pipe(int *r, int *w) {
+    int fds[2];
 
-    if(sigaction(SIGTERM, &sig, NULL) == -1) {
-        err(1, "could not set SIGTERM handler");
+    if(pipe(fds) == -1) {
+        err(1, "pipe()");
     }
 
-    if(sigaction(SIGINT, &sig, NULL) == -1) {
-        err(1, "could not set SIGINT handler");
+    for(int i = 0; i < 2; i += 1) {
+        if(fcntl(fds[i], F_SETFL, O_NONBLOCK) == -1 || fcntl(fds[i], F_SETFD, FD_CLOEXEC) == -1) {
+            err(1, "fcntl()");
+        }
     }
 
-    if(sigaction(SIGUSR1, &sig, NULL) == -1) {
-        err(1, "could not set SIGUSR1 handler");
-    }
+    *r = fds[0];
+    *w = fds[1];
+}
 
-    if(sigaction(SIGUSR2, &sig, NULL) == -1) {
-        err(1, "could not set SIGUSR2 handler");
-    }
+void start_workers() {
+    sigset_t all;
+    sigset_t previous;
 
-    if(sigaction(SIGCHLD, &sig, NULL) == -1) {
-        err(1, "could not set SIGCHLD handler");
+    for(int i = 0; i < destination_count; i += 1) {
+        ring_owners[i] = -1;
     }
 
-    if(sigaction(SIGALRM, &sig, NULL) == -1) {
-        err(1, "could not set SIGALRM handler");
-    }
-}
+    for(int i = 0; i < IO_WORKERS; i += 1) {
+        struct worker *worker = &workers[i];
 
-void teardown() {
-    if(teardown_in_progress) {
-        return;
-    }
+        setup_worker_pipe(&worker->wake_r, &worker->wake_w);
+        setup_worker_pipe(&worker->doorbell_r, &worker->doorbell_w);
+        worker->wake_source = (struct event_source){ .fd = worker->wake_r, .flavour = FLAVOUR_WAKE, .events = EVENT_READ, .index = -1, .object = worker };
+        worker->doorbell_source = (struct event_source){ .fd = worker->doorbell_r, .flavour = FLAVOUR_WORKER, .events = EVENT_READ, .index = -1, .object = worker };
 
-    printf("[SYSTEM] Asking all processes to exit.\n");
+        for(int j = 0; j < destination_count; j += 1) {
+            struct output *output = calloc(1, sizeof(struct output));
+            struct ring *ring = calloc(1, sizeof(struct ring));
 
-    teardown_in_progress = 1;
+            if(output == NULL || ring == NULL) {
+                err(1, "calloc()");
+            }
 
-    for(int i = 0; i < CHILDREN_COUNT; i += 1) {
-        if(!children[i].running) {
-            continue;
+            output->fd = -1;
+            output->original_flags = -1;
+            output->source = (struct event_source){ .fd = -1, .index = -1 };
+            output->ring = ring;
+            output->worker = worker;
+            worker->outputs[j] = output;
+            worker->rings[j] = ring;
         }
 
-        kill(children[i].pid, children[i].config->termination_signal);
+        if(event_add(&worker->doorbell_source) == -1) {
+            exit(1);
+        }
     }
 
-    alarm(SHUTDOWN_TIMEOUT);
-}
+    // signals are left to the main thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
 
-__attribute__((noreturn))
-void brutal_teardown() {
-    for(int i = 0; i < CHILDREN_COUNT; i += 1) {
-        if(children[i].running) {
-            kill(children[i].pid, SIGKILL);
+    for(int i = 0; i < IO_WORKERS; i += 1) {
+        int rv = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+
+        if(rv != 0) {
+            errno = rv;
+            err(1, "pthread_create()");
         }
     }
 
-    exit(1);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
 }
 
-void reap(pid_t pid, int exit_status) {
-    for(int i = 0; i < CHILDREN_COUNT; i += 1) {
-        if(children[i].pid == pid && children[i].running) {
-            children[i].pid = -1;
-            children[i].running = 0;
-
-            close(children[i].err_buffer.source_fd);
-            close(children[i].out_buffer.source_fd);
-
-            children[i].err_buffer.source_fd = -1;
-            children[i].out_buffer.source_fd = -1;
+// lets the workers pass on the last of what they read before exiting
+void stop_workers() {
+    for(int i = 0; i < IO_WORKERS; i += 1) {
+        send_worker_command(&workers[i], WORKER_STOP, NULL, NULL);
+    }
 
-            if(children[i].config->is_startup_check) {
-                if(exit_status == 0) {
-                    printf("[SYSTEM] Process for %s (%lli) has indicated success.\n", children[i].config->name, (long long int)pid);
-                } else {
-                    printf("[SYSTEM] Process for %s (%lli) has indicated failure.\n", children[i].config->name, (long long int)pid);
-                }
-            } else {
-                printf("[SYSTEM] Process for %s (%lli) has exited.\n", children[i].config->name, (long long int)pid);
+    for(int i = 0; i < IO_WORKERS; i += 1) {
+        while(!atomic_load(&workers[i].finished)) {
+            if(event_wait(100) > 0) {
+                handle_io();
             }
 
-            break;
+            drain_workers(0);
+            flush_outputs();
         }
+
+        pthread_join(workers[i].thread, NULL);
+
+#ifdef SUPERVISOR_BENCHMARK
+        bench_lines += workers[i].bench_lines;
+        histogram_merge(&bench_latency, &workers[i].bench_latency);
+#endif
     }
-}
 
-void flush_buffer(struct buffer *buffer, const char *child_name) {
-    *(&buffer->buffer[0] + buffer->position) = 0;
-    dprintf(buffer->destination_fd, "[%s] %s\n", child_name, &buffer->buffer[0]);
-    buffer->position = 0;
+    drain_workers(1);
 }
+#endif
 
-int pump_buffer(struct buffer *buffer, const char *child_name) {
-    size_t buffer_space_left = MAX_LINE_LENGTH - buffer->position;
-    char tmp_buffer[MAX_LINE_LENGTH];
-    ssize_t bytes_read = read(buffer->source_fd, &tmp_buffer[0], buffer_space_left);
+int pump() {
+    int ready = event_wait(timer_timeout());
+    uint64_t woken_at = monotonic_ns();
 
-    if(bytes_read == -1) {
-        return -1;
-    }
+    update_line_clock();
 
-    if(bytes_read == 0) {
-        flush_buffer(buffer, child_name);
-        return 0;
-    }
+    uint64_t timers_expired = timer_lateness.count;
+    int busy = 0;
 
-    char *inp = &tmp_buffer[0];
-    char *outp = &buffer->buffer[0] + buffer->position;
+    loop_iterations += 1;
 
-    for(int bytes_processed = 0; bytes_processed < bytes_read; bytes_processed += 1, inp += 1) {
-        if(*inp == '\r') {
-        } else if(*inp == '\n') {
-            flush_buffer(buffer, child_name);
-            outp = &buffer->buffer[0];
-        } else if(*inp < ' ' || *inp == 127) {
-            *outp = ' ';
-            outp += 1;
-            buffer->position += 1;
-        } else {
-            *outp = *inp;
-            outp += 1;
-            buffer->position += 1;
-        }
+    if(ready > 0) {
+        loop_wakeups += 1;
+        busy = handle_io();
     }
 
-    if(buffer_space_left == 0) {
-        flush_buffer(buffer, child_name);
+    timer_run();
+
+    // metrics only need rendering again once something else has happened
+    if(busy || timer_lateness.count != timers_expired) {
+        stats_generation += 1;
     }
+    check_signals();
+    check_for_terminations();
 
-    return 1;
-}
+#if IO_WORKERS > 0
+    drain_workers(0);
+#endif
+    flush_outputs();
 
-void check_signals() {
-    if(termination_signal_received) {
-        termination_signal_received = 0;
-        printf("[SYSTEM] Received request to terminate.\n");
-        if(teardown_in_progress) {
-            printf("[SYSTEM] Shutdown already in progress, so performing hard shutdown.\n");
-            brutal_teardown();
-        }
-        printf("[SYSTEM] Performing soft shutdown.\n");
-        teardown();
-    }
+    histogram_record(&loop_busy, monotonic_ns() - woken_at);
 
-    if(sigusr1_received) {
-        sigusr1_received = 0;
+    return check_pending();
+}
 
-        printf("[SYSTEM] Received SIGUSR1.\n");
+#ifdef SUPERVISOR_BENCHMARK
+// fills the text of lines, between their time stamps and line feeds
+void bench_fill(char *data, size_t size, int content) {
+    static const char utf8[] = "gr\xc3\xbc\xc3\x9f" "e \xce\xba\xcf\x8c\xcf\x83\xce\xbc\xce\xb5 \xe4\xb8\x96\xe7\x95\x8c \xf0\x9f\x99\x82 ";
+    static const char control[] = "key\tvalue \x1b[1mbold\x1b[0m ";
+    const char *pattern = content == BENCH_CONTENT_UTF8 ? utf8 : control;
+    size_t pattern_length = content == BENCH_CONTENT_UTF8 ? sizeof(utf8) - 1 : sizeof(control) - 1;
 
-        for(int i = 0; i < CHILDREN_COUNT; i += 1) {
-            if(!children[i].running) {
-                continue;
-            }
-            if(children[i].config->receives_sigusr1) {
-                printf("[SYSTEM] Passing SIGUSR1 to child %s (%lli).\n", children[i].config->name, (long long int)children[i].pid);
-                kill(children[i].pid, SIGUSR1);
-            }
-        }
+    if(content == BENCH_CONTENT_ASCII) {
+        memset(data, 'x', size);
+        return;
     }
 
-    if(sigusr2_received) {
-        sigusr2_received = 0;
+    for(size_t i = 0; i < size; i += 1) {
+        data[i] = pattern[i % pattern_length];
+    }
+}
 
-        printf("[SYSTEM] Received SIGUSR2.\n");
+__attribute__((noreturn))
+void bench_generate(long lines_per_second, long line_length, long burst, long duration, int content) {
+    static const char digits[] = "0123456789abcdef";
 
-        for(int i = 0; i < CHILDREN_COUNT; i += 1) {
-            if(!children[i].running) {
-                continue;
-            }
-            if(children[i].config->receives_sigusr2) {
-                printf("[SYSTEM] Passing SIGUSR2 to child %s (%lli).\n", children[i].config->name, (long long int)children[i].pid);
-                kill(children[i].pid, SIGUSR2);
-            }
-        }
+    // room for the time stamp, a space and the line feed
+    if(line_length < 18) {
+        line_length = 18;
     }
 
-    if(sigalrm_received) {
-        sigalrm_received = 0;
+    if(lines_per_second < 1 || burst < 1) {
+        errx(1, "lines per second and burst must be positive");
+    }
 
-        printf("[SYSTEM] Shutdown timeout has arrived, performing hard shutdown.\n");
+    size_t size = line_length * burst;
+    char *data = malloc(size);
 
-        brutal_teardown();
+    if(data == NULL) {
+        err(1, "malloc()");
     }
-}
 
-void check_for_terminations(int phase) {
-    while(1) {
-        int status;
-        pid_t pid = waitpid(-1, &status, WNOHANG);
+    for(long i = 0; i < burst; i += 1) {
+        bench_fill(&data[i * line_length + 17], line_length - 18, content);
+        data[i * line_length + 16] = ' ';
+        data[(i + 1) * line_length - 1] = '\n';
+    }
 
-        if(pid < 1) {
-            break;
+    uint64_t interval = (uint64_t)burst * 1000000000ULL / lines_per_second;
+    uint64_t now = monotonic_ns();
+    uint64_t next = now;
+    uint64_t end = now + (uint64_t)duration * 1000000000ULL;
+
+    while(now < end) {
+        for(long i = 0; i < burst; i += 1) {
+            for(int j = 0; j < 16; j += 1) {
+                data[i * line_length + j] = digits[(now >> (60 - j * 4)) & 15];
+            }
         }
 
-        reap(pid, status);
+        for(size_t written = 0; written < size;) {
+            ssize_t rv = write(STDOUT_FILENO, data + written, size - written);
 
-        if(WEXITSTATUS(status) != 0 || phase != PHASE_CHECK) {
-            teardown();
+            if(rv == -1) {
+                if(errno == EINTR) {
+                    continue;
+                }
+                err(1, "write()");
+            }
+
+            written += rv;
         }
-    }
-}
 
-int check_pending() {
-    int some_child_running = 0;
+        next += interval;
+        now = monotonic_ns();
 
-    for(int i = 0; i < CHILDREN_COUNT; i += 1) {
-        if(children[i].running) {
-            some_child_running = 1;
-            break;
+        if(next > now) {
+            struct timespec delay = { .tv_sec = (next - now) / 1000000000ULL, .tv_nsec = (next - now) % 1000000000ULL };
+
+            nanosleep(&delay, NULL);
+            now = monotonic_ns();
         }
     }
 
-    return some_child_running;
+    exit(0);
 }
 
-#define FLAVOUR_SIGNAL (-1)
-#define FLAVOUR_STDOUT (1)
-#define FLAVOUR_STDERR (2)
+// times the scanner against its scalar form on each kind of content, as a
+// scrubbing pass over it would use them; SCALAR_LINE_SCANNER makes both the
+// same
+__attribute__((noreturn))
+void bench_scan() {
+    static const char *names[] = { "ASCII", "UTF-8", "control-heavy" };
+    size_t size = 1024 * 1024;
+    unsigned char *data = malloc(size);
+    volatile size_t stops = 0;
 
-struct poll_data {
-    nfds_t count;
-    struct pollfd entry[CHILDREN_COUNT * 2 + 1];
-    struct child_state *child[CHILDREN_COUNT * 2 + 1];
-    int flavour[CHILDREN_COUNT * 2 + 1];
-};
+    if(data == NULL) {
+        err(1, "malloc()");
+    }
 
-void setup_poll(struct poll_data *data) {
-    data->count = 0;
+    for(int content = BENCH_CONTENT_ASCII; content <= BENCH_CONTENT_CONTROL; content += 1) {
+        double rates[2];
 
-    data->entry[data->count].fd = signal_r;
-    data->entry[data->count].events = POLLIN;
-    data->entry[data->count].revents = 0;
-    data->child[data->count] = NULL;
-    data->flavour[data->count] = FLAVOUR_SIGNAL;        
-    data->count += 1;
+        bench_fill((char *)data, size, content);
 
-    for(int i = 0; i < CHILDREN_COUNT; i += 1) {
-        struct child_state *child = &children[i];
+        for(int scalar = 0; scalar < 2; scalar += 1) {
+            uint64_t started_at = monotonic_ns();
+            int rounds = 0;
 
-        if(!child->running) {
-            continue;
-        }
+            do {
+                for(size_t i = 0; i < size; i += 1) {
+                    i += scalar ? clean_span_scalar(data + i, size - i) : clean_span(data + i, size - i);
+                    stops += 1;
+                }
 
-        if(child->out_buffer.source_fd != -1) {
-            data->entry[data->count].fd = child->out_buffer.source_fd;
-            data->entry[data->count].events = POLLIN;
-            data->entry[data->count].revents = 0;
-            data->child[data->count] = child;
-            data->flavour[data->count] = FLAVOUR_STDOUT;
-            data->count += 1;
-        }
+                rounds += 1;
+            } while(monotonic_ns() - started_at < 500000000ULL);
 
-        if(child->err_buffer.source_fd != -1) {
-            data->entry[data->count].fd = child->err_buffer.source_fd;
-            data->entry[data->count].events = POLLIN;
-            data->entry[data->count].revents = 0;
-            data->child[data->count] = child;
-            data->flavour[data->count] = FLAVOUR_STDERR;
-            data->count += 1;
+            rates[scalar] = (double)rounds * size / ((monotonic_ns() - started_at) / 1e9) / (1024 * 1024 * 1024);
         }
-    }
-}
 
-void handle_io(struct poll_data *data) {
-    for(int j = 0; j < data->count; j += 1) {
-        if((data->entry[j].revents & POLLIN) != POLLIN) {
-            continue;
-        }
+        fprintf(stderr, "[BENCH] scan %s: %.2f GiB/s, scalar %.2f GiB/s\n", names[content], rates[0], rates[1]);
+    }
 
-        if(data->flavour[j] == FLAVOUR_SIGNAL) {
-            char dummy[1000];
-            read(signal_r, &dummy[0], 1000);
-            continue;
-        }
+    exit(0);
+}
 
-        struct child_state *child = data->child[j];
-        struct buffer *buffer = (data->flavour[j] == FLAVOUR_STDOUT) ? &child->out_buffer : &child->err_buffer;
+void bench_report(uint64_t started_at) {
+    double elapsed = (monotonic_ns() - started_at) / 1e9;
+    struct rusage usage;
 
-        if(pump_buffer(buffer, child->config->name) < 1) {
-            close(data->entry[j].fd);
+    getrusage(RUSAGE_SELF, &usage);
 
-            if(data->flavour[j] == FLAVOUR_STDOUT) {
-                child->out_buffer.source_fd = -1;
-            }
+    double user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+    double system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
 
-            if(data->flavour[j] == FLAVOUR_STDERR) {
-                child->err_buffer.source_fd = -1;
-            }
-        }
-    } 
+    fprintf(stderr, "[BENCH] spawned %i children in %.3f ms\n", INSTANCES_COUNT, (bench_spawned_at - started_at) / 1e6);
+    fprintf(stderr, "[BENCH] %llu lines in %.3f s, %.0f lines/s\n", (unsigned long long)bench_lines, elapsed, bench_lines / elapsed);
+    fprintf(stderr, "[BENCH] %llu bytes written, %.2f MiB/s\n", (unsigned long long)bench_bytes, bench_bytes / elapsed / (1024 * 1024));
+    fprintf(stderr, "[BENCH] supervisor cpu: %.3f s user, %.3f s system, %.1f%% of one core\n", user, system, (user + system) / elapsed * 100);
+    fprintf(stderr, "[BENCH] write to output latency: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+        histogram_percentile(&bench_latency, 50) / 1e3, histogram_percentile(&bench_latency, 99) / 1e3, bench_latency.max / 1e3);
 }
+#endif
 
-int pump(int phase) {
-    struct poll_data data;
+int main(int argc, char **argv) {
+    setup_instances();
 
-    setup_poll(&data);
+    // binding needs the file system, before it is hidden below
+    if(METRICS_SOCKET) {
+        open_metrics_socket();
+    }
 
-    int status = poll(&data.entry[0], data.count, -1);
+    open_log_files();
+    open_listen_sockets();
 
-    if(status == -1 && errno != EINTR) {
-        warn("poll()");
+#ifdef __OpenBSD__
+    if(unveil("/", "x") == -1) {
+        err(1, "unveil()");
     }
 
-    if(status > 0) {
-        handle_io(&data);
+    for(int i = 0; i < log_file_count; i += 1) {
+        unveil_log_directory(log_files[i].path);
     }
 
-    check_signals();
-    check_for_terminations(phase);
+    if(log_rings_configured() && unveil("/tmp", "rwc") == -1) {
+        err(1, "unveil(/tmp)");
+    }
 
-    return check_pending();
-}
+    for(int i = 0; i < CHILDREN_COUNT; i += 1) {
+        const struct probe_configuration *probe = &child_configuration[i].probe;
 
-void startup_check() {
-    int result = setup_children(PHASE_CHECK);
+        if((probe->kind == PROBE_UNIX || probe->kind == PROBE_FILE) && unveil(probe->target, probe->kind == PROBE_UNIX ? "w" : "r") == -1) {
+            err(1, "unveil(%s)", probe->target);
+        }
+    }
 
-    if(result == -1) {
-        printf("[SYSTEM] Not all check commands could be spawned.\n");
-        teardown();
-    } else if(result == 0) {
-        return;
+    pledge_supervisor(1);
+#endif
+
+#ifdef SUPERVISOR_BENCHMARK
+    if(argc == 7 && strcmp(argv[1], "--generate") == 0) {
+        bench_generate(atol(argv[2]), atol(argv[3]), atol(argv[4]), atol(argv[5]), atoi(argv[6]));
     }
 
-    while(pump(PHASE_CHECK)) {}
+    if(argc == 2 && strcmp(argv[1], "--scan") == 0) {
+        bench_scan();
+    }
 
-    if(!teardown_in_progress) {
-        printf("[SYSTEM] All startup checks have passed.\n");
+    if(strchr(argv[0], '/') == NULL) {
+        errx(1, "the benchmark must be started through a path, such as ./%s", argv[0]);
     }
-}
 
-void normal_phase() {
-    int result = setup_children(PHASE_NORMAL);
+    bench_self = argv[0];
+#endif
 
-    if(result == -1) {
-        printf("[SYSTEM] Not all children could be spawned.\n");
-        teardown();
-    } else if(result == 0) {
-        printf("[SYSTEM] No children specified in configuration, exiting.\n");
-        return;
-    } else {
-        printf("[SYSTEM] All processes have been spawned.\n");
+    if(argc > 1) {
+        errx(1, "no command line arguments accepted");
     }
 
-#ifdef __OpenBSD__
-    if(pledge("stdio proc", NULL) == -1) {
-        err(1, "pledge()");
+    setup_configuration();
+#ifdef __linux__
+    setup_cgroups();
+
+    // whatever the children leave running is reparented here rather than to
+    // init, so it can be reaped
+    if(prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+        warn("could not become a subreaper");
     }
 #endif
+    setup_prefixes();
+    update_line_clock();
 
-    while(pump(PHASE_NORMAL)) {};
+    // startup checks are still run when they are all there is
+    int no_children = normal_pending == 0;
 
-    printf("[SYSTEM] All child processes have exited.\n");
-}
-
-int main(int argc, char **argv) {
-#ifdef __OpenBSD__
-    if(unveil("/", "x") == -1) {
-        err(1, "unveil()");
+    if(no_children && checks_pending == 0) {
+        system_message("No children specified in configuration, exiting.");
+        flush_outputs();
+        return 1;
     }
 
-    if(pledge("stdio proc exec", NULL) == -1) {
-        err(1, "pledge()");
+    if(log_file_count > 0 && LOG_FILE_SYNC_INTERVAL > 0) {
+        start_sync_helper();
     }
+
+    event_init();
+    timer_init();
+    setup_outputs();
+#if IO_WORKERS > 0
+    start_workers();
 #endif
 
-    if(argc > 1) {
-        errx(1, "no command line arguments accepted");
+    if(log_file_count > 0) {
+        log_flush_timer.expire = log_flush_expired;
+        timer_set(&log_flush_timer, LOG_FILE_FLUSH_INTERVAL);
+
+        if(LOG_FILE_SYNC_INTERVAL > 0) {
+            log_sync_timer.expire = log_sync_expired;
+            timer_set(&log_sync_timer, LOG_FILE_SYNC_INTERVAL);
+        }
+    }
+    for(int i = 0; i < CHILDREN_COUNT; i += 1) {
+        if(rate_limited(&child_configuration[i])) {
+            rate_limit_timer.expire = rate_limit_report_expired;
+            timer_set(&rate_limit_timer, RATE_LIMIT_REPORT_INTERVAL);
+        }
     }
 
     setup_signal_handler();
 
-    startup_check();
+    if(METRICS_SOCKET && event_add(&metrics_listener) == -1) {
+        exit(1);
+    }
 
-    if(teardown_in_progress) {
-        printf("[SYSTEM] Startup check failed, shutting down.\n");
-        return 1;
+#ifdef SUPERVISOR_BENCHMARK
+    uint64_t started_at = monotonic_ns();
+#endif
+
+    schedule_children();
+
+    while(pump()) {}
+
+#if IO_WORKERS > 0
+    stop_workers();
+#endif
+    report_rate_limits();
+
+    if(no_children && !teardown_in_progress) {
+        system_message("No children specified in configuration, exiting.");
+    } else {
+        system_message("All child processes have exited.");
     }
 
-    normal_phase();
+    finish_outputs();
+
+#ifdef SUPERVISOR_BENCHMARK
+    bench_report(started_at);
+#endif
 
     return 1;
 }